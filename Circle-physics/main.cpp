@@ -3,6 +3,11 @@
 #include <cstdlib>
 #include <cmath>
 #include <random>
+#include <iostream>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include "../circle-batch.h"
 
 struct Circle {
     sf::Vector2f position;
@@ -11,7 +16,7 @@ struct Circle {
     float mass;
     int radius;
 
-    sf::CircleShape circleshape;
+    sf::Color color;
 
     Circle(sf::Vector2f position_ = sf::Vector2f(0.0f, 0.0f), float mass_ = 1.0, int radius_ = 10, sf::Color color_ = sf::Color::White) {
         position = position_;
@@ -19,11 +24,7 @@ struct Circle {
 
         mass = mass_;
         radius = radius_;
-        
-        circleshape.setFillColor(color_);
-        circleshape.setOrigin(sf::Vector2f(radius, radius));
-        circleshape.setPosition(position);
-        circleshape.setRadius(radius);
+        color = color_;
     }
 };
 float dot(const sf::Vector2f& a, const sf::Vector2f& b) {
@@ -42,6 +43,263 @@ sf::Vector2f reflect(const sf::Vector2f& v, const sf::Vector2f& axis) {
     sf::Vector2f n = normalized(axis); // ensure the axis is normalized
     return v - 2.f * dot(v, n) * n;
 }
+
+// Finds the pairs of circles (i < j) whose bounding boxes overlap, so only those
+// have to go through the exact (and more expensive) overlap test
+class BroadPhase {
+    public:
+        virtual ~BroadPhase() {}
+        virtual const char* name() const = 0;
+        virtual void findPairs(const std::vector<Circle>& circles, std::vector<std::pair<int, int>>& pairs) = 0;
+};
+
+bool boundsOverlap(const Circle& a, const Circle& b) {
+    float radiiSum = a.radius + b.radius;
+    return std::abs(a.position.x - b.position.x) < radiiSum && std::abs(a.position.y - b.position.y) < radiiSum;
+}
+
+// Uniform grid with cells as big as the largest circle. Every circle is sorted into the cell of its
+// center, so overlapping circles are always in the same or in neighbouring cells.
+class GridBroadPhase : public BroadPhase {
+    public:
+        int width;
+        int height;
+
+    GridBroadPhase(int width_, int height_) {
+        width = width_;
+        height = height_;
+    }
+
+    const char* name() const override {
+        return "uniform grid";
+    }
+
+    void findPairs(const std::vector<Circle>& circles, std::vector<std::pair<int, int>>& pairs) override {
+        pairs.clear();
+        int count = circles.size();
+        if (count == 0) {
+            return;
+        }
+
+        int maxRadius = 1;
+        for (const Circle &circle : circles) {
+            maxRadius = std::max(maxRadius, circle.radius);
+        }
+        cellSize = 2.0f * maxRadius;
+        columns = std::max(1, (int)std::ceil(width / cellSize));
+        rows = std::max(1, (int)std::ceil(height / cellSize));
+
+        // Counting sort of the circles by cell
+        cellStart.assign(columns * rows + 1, 0);
+        circleCell.resize(count);
+        cellEntries.resize(count);
+        for (int i = 0; i < count; ++i) {
+            circleCell[i] = cellIndex(circles[i].position);
+            cellStart[circleCell[i] + 1]++;
+        }
+        for (int c = 0; c < columns * rows; ++c) {
+            cellStart[c + 1] += cellStart[c];
+        }
+        fill.assign(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < count; ++i) {
+            cellEntries[fill[circleCell[i]]++] = i;
+        }
+
+        // Same cell, then only the "forward" half of the neighbours so every pair shows up once
+        const int neighborOffsets[4][2] = {{1, 0}, {-1, 1}, {0, 1}, {1, 1}};
+        for (int cy = 0; cy < rows; ++cy) {
+            for (int cx = 0; cx < columns; ++cx) {
+                int cell = cy * columns + cx;
+                for (int a = cellStart[cell]; a < cellStart[cell + 1]; ++a) {
+                    int i = cellEntries[a];
+                    for (int b = a + 1; b < cellStart[cell + 1]; ++b) {
+                        addIfOverlapping(circles, i, cellEntries[b], pairs);
+                    }
+                    for (const auto &offset : neighborOffsets) {
+                        int nx = cx + offset[0];
+                        int ny = cy + offset[1];
+                        if (nx < 0 || nx >= columns || ny >= rows) {
+                            continue;
+                        }
+                        int neighborCell = ny * columns + nx;
+                        for (int b = cellStart[neighborCell]; b < cellStart[neighborCell + 1]; ++b) {
+                            addIfOverlapping(circles, i, cellEntries[b], pairs);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    private:
+        float cellSize;
+        int columns;
+        int rows;
+        std::vector<int> cellStart;
+        std::vector<int> cellEntries;
+        std::vector<int> circleCell;
+        std::vector<int> fill;
+
+    int cellIndex(sf::Vector2f position) const {
+        int cx = std::clamp((int)(position.x / cellSize), 0, columns - 1);
+        int cy = std::clamp((int)(position.y / cellSize), 0, rows - 1);
+        return cy * columns + cx;
+    }
+
+    static void addIfOverlapping(const std::vector<Circle>& circles, int i, int j, std::vector<std::pair<int, int>>& pairs) {
+        if (boundsOverlap(circles[i], circles[j])) {
+            pairs.push_back(std::minmax(i, j));
+        }
+    }
+};
+
+// Sweep and prune on x. The order from the last frame is kept, circles barely move
+// between frames, so the insertion sort is close to linear.
+class SweepAndPruneBroadPhase : public BroadPhase {
+    public:
+    const char* name() const override {
+        return "sweep and prune";
+    }
+
+    void findPairs(const std::vector<Circle>& circles, std::vector<std::pair<int, int>>& pairs) override {
+        pairs.clear();
+        int count = circles.size();
+        auto minX = [&](int i) { return circles[i].position.x - circles[i].radius; };
+        if ((int)order.size() != count) {
+            // No order from the last frame yet
+            order.resize(count);
+            for (int i = 0; i < count; ++i) {
+                order[i] = i;
+            }
+            std::sort(order.begin(), order.end(), [&](int i, int j) { return minX(i) < minX(j); });
+        }
+
+        for (int a = 1; a < count; ++a) {
+            int index = order[a];
+            float key = minX(index);
+            int b = a - 1;
+            while (b >= 0 && minX(order[b]) > key) {
+                order[b + 1] = order[b];
+                --b;
+            }
+            order[b + 1] = index;
+        }
+
+        for (int a = 0; a < count; ++a) {
+            int i = order[a];
+            float maxX = circles[i].position.x + circles[i].radius;
+            for (int b = a + 1; b < count && minX(order[b]) < maxX; ++b) {
+                int j = order[b];
+                if (boundsOverlap(circles[i], circles[j])) {
+                    pairs.push_back(std::minmax(i, j));
+                }
+            }
+        }
+    }
+
+    private:
+        std::vector<int> order;
+};
+
+// Pushes two overlapping circles apart, half the overlap each
+void resolveOverlap(Circle& circle, Circle& otherCircle) {
+    sf::Vector2f difference = otherCircle.position - circle.position;
+    float radiiSum = circle.radius + otherCircle.radius;
+    float distanceSquared = dot(difference, difference);
+    if (distanceSquared >= radiiSum * radiiSum || distanceSquared == 0.0f) {
+        return;
+    }
+
+    float distance = std::sqrt(distanceSquared);
+    sf::Vector2f direction = difference / distance;
+
+    float goBackDistance = (radiiSum - distance) / 2.0f;
+    otherCircle.position += direction * goBackDistance;
+    circle.position -= direction * goBackDistance;
+}
+
+// Splits the contacts into batches where no circle shows up twice, so every batch
+// can be solved in parallel without two threads moving the same circle
+class ContactSolver {
+    public:
+        // Contacts that didn't get one of the first maxColors colors end up in the last batch, which is solved serially
+        static const int maxColors = 64;
+
+        int iterations;
+
+    ContactSolver(int iterations_ = 4) {
+        iterations = iterations_;
+    }
+
+    // Greedy coloring: every contact gets the lowest color neither of its circles uses yet
+    void colorContacts(int circleCount, const std::vector<std::pair<int, int>>& contacts) {
+        usedColors.assign(circleCount, 0);
+        contactColor.resize(contacts.size());
+        batchStart.assign(maxColors + 2, 0);
+
+        for (std::size_t c = 0; c < contacts.size(); ++c) {
+            std::uint64_t used = usedColors[contacts[c].first] | usedColors[contacts[c].second];
+            int color = maxColors;
+            if (~used != 0) {
+                color = __builtin_ctzll(~used);
+                usedColors[contacts[c].first] |= 1ull << color;
+                usedColors[contacts[c].second] |= 1ull << color;
+            }
+            contactColor[c] = color;
+            batchStart[color + 1]++;
+        }
+
+        for (int color = 0; color <= maxColors; ++color) {
+            batchStart[color + 1] += batchStart[color];
+        }
+        fill.assign(batchStart.begin(), batchStart.end() - 1);
+        batches.resize(contacts.size());
+        for (std::size_t c = 0; c < contacts.size(); ++c) {
+            batches[fill[contactColor[c]]++] = contacts[c];
+        }
+    }
+
+    // The broad phase runs again every iteration, pushes from the iteration before can create new overlaps
+    void solve(std::vector<Circle>& circles, BroadPhase& broadPhase, int width, int height) {
+        for (int iteration = 0; iteration < iterations; ++iteration) {
+            broadPhase.findPairs(circles, candidatePairs);
+            if (candidatePairs.empty()) {
+                break;
+            }
+            colorContacts(circles.size(), candidatePairs);
+
+            for (int color = 0; color < maxColors; ++color) {
+                int begin = batchStart[color];
+                int end = batchStart[color + 1];
+                #pragma omp parallel for schedule(static) if(end - begin > 256)
+                for (int c = begin; c < end; ++c) {
+                    resolveOverlap(circles[batches[c].first], circles[batches[c].second]);
+                }
+            }
+            for (int c = batchStart[maxColors]; c < batchStart[maxColors + 1]; ++c) {
+                resolveOverlap(circles[batches[c].first], circles[batches[c].second]);
+            }
+
+            // Pushing circles apart can push them into the walls again
+            int circleCount = circles.size();
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < circleCount; ++i) {
+                Circle &circle = circles[i];
+                circle.position.x = std::clamp<float>(circle.position.x, circle.radius, width - circle.radius);
+                circle.position.y = std::clamp<float>(circle.position.y, circle.radius, height - circle.radius);
+            }
+        }
+    }
+
+    private:
+        std::vector<std::pair<int, int>> candidatePairs;
+        std::vector<std::uint64_t> usedColors;
+        std::vector<int> contactColor;
+        std::vector<int> batchStart;
+        std::vector<int> fill;
+        std::vector<std::pair<int, int>> batches;
+};
+
 int main() {
     float gravity = 1.0;
     std::vector<Circle> circles;
@@ -56,16 +314,38 @@ int main() {
     // Define a uniform distribution between 0 and 1
     std::uniform_real_distribution<> rand(0.0, 1.0);
 
+    int circleAmount;
+    std::cout << "\nCircle amount: ";
+    std::cin >> circleAmount;
+
+    int circleRadius;
+    std::cout << "\nCircle radius: ";
+    std::cin >> circleRadius;
 
-    for (int i = 0; i < 100; i++) {
-        Circle circle = Circle(sf::Vector2f(width / 2.0, height / 4.0));
+    // Spawn around the same point as before, spread out enough that large amounts don't all start on top of each other
+    float spawnSpread = std::min<float>(std::sqrt((float)circleAmount) * circleRadius, width / 2.0f - circleRadius);
+    for (int i = 0; i < circleAmount; i++) {
+        sf::Vector2f offset((rand(gen) - 0.5f) * spawnSpread, (rand(gen) - 0.5f) * spawnSpread);
+        Circle circle = Circle(sf::Vector2f(width / 2.0, height / 4.0) + offset, 1.0, circleRadius);
         circle.velocity = sf::Vector2f((rand(gen) - 0.5f) * 20.0f, (rand(gen) - 0.5f) * 20.0f);
         circles.push_back(circle);
     }
 
+    int solverIterations;
+    std::cout << "\nSolver iterations: ";
+    std::cin >> solverIterations;
+
+    // B switches between the broad phases
+    GridBroadPhase gridBroadPhase(width, height);
+    SweepAndPruneBroadPhase sweepBroadPhase;
+    BroadPhase* broadPhase = &gridBroadPhase;
+    ContactSolver solver(solverIterations);
+
 
     sf::RenderWindow window(sf::VideoMode(width, height), "cirkel simultion");
     window.setFramerateLimit(60);
+
+    CircleBatch batch;
     while (window.isOpen()) {
         // Event loop
         sf::Event event;
@@ -73,6 +353,10 @@ int main() {
             if (event.type == sf::Event::Closed){
                 window.close();
             }
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::B) {
+                broadPhase = (broadPhase == &gridBroadPhase) ? (BroadPhase*)&sweepBroadPhase : (BroadPhase*)&gridBroadPhase;
+                std::cout << broadPhase->name() << "\n";
+            }
         }
 
         window.clear();
@@ -80,50 +364,37 @@ int main() {
             // Set the position
             circle.velocity += sf::Vector2f(0.0f, gravity * circle.mass);
             circle.position += circle.velocity;
+        }
 
-            for (int i = 0; i < 1; i++) {
-                // Collision detection (edges)
-                if (circle.position.x <= 0 + circle.radius) {
-                    circle.velocity.x *= -1.0;
-                    circle.position.x = circle.radius;
-                }
-                if (circle.position.x >= width - circle.radius) {
-                    circle.velocity.x *= -1.0;
-                    circle.position.x = width - circle.radius;
-                }
-                if (circle.position.y <= 0 + circle.radius) {
-                    circle.velocity.y *= -1.0;
-                    circle.position.y = circle.radius;
-                }
-                if (circle.position.y >= height - circle.radius) {
-                    circle.velocity.y *= -1.0;
-                    circle.position.y = height - circle.radius;
-                }
-
-                // Collision detection (other circles)
-                for (Circle &otherCircle : circles) {
-                    if (&otherCircle == &circle) {
-                        continue;
-                    }
-                    float distance = hypot(otherCircle.position - circle.position);
-                    sf::Vector2f direction = normalized(otherCircle.position - circle.position);
-                    
-                    float radiiSum = circle.radius + otherCircle.radius;
-                    if (distance < radiiSum){
-                        sf::Vector2f relativeVelocity = otherCircle.velocity - circle.velocity;
-                        sf::Vector2f otherCircleRelativeVelocity = circle.velocity - otherCircle.velocity;
-
-                        float goBackDistance = (radiiSum - distance) / 2.0f;
-                        otherCircle.position += direction * goBackDistance;
-                        circle.position -= direction * goBackDistance;
-                    }
-                }   
+        // Collision detection (edges)
+        for (Circle &circle : circles) {
+            if (circle.position.x <= 0 + circle.radius) {
+                circle.velocity.x *= -1.0;
+                circle.position.x = circle.radius;
             }
+            if (circle.position.x >= width - circle.radius) {
+                circle.velocity.x *= -1.0;
+                circle.position.x = width - circle.radius;
+            }
+            if (circle.position.y <= 0 + circle.radius) {
+                circle.velocity.y *= -1.0;
+                circle.position.y = circle.radius;
+            }
+            if (circle.position.y >= height - circle.radius) {
+                circle.velocity.y *= -1.0;
+                circle.position.y = height - circle.radius;
+            }
+        }
+
+        // Collision detection (other circles), only for the pairs the broad phase hands out
+        solver.solve(circles, *broadPhase, width, height);
 
-            // Draw the circle
-            circle.circleshape.setPosition(circle.position);
-            window.draw(circle.circleshape);
+        // Draw the circles
+        batch.resize(circles.size());
+        for (std::size_t i = 0; i < circles.size(); ++i) {
+            batch.set(i, circles[i].position, circles[i].radius, circles[i].color);
         }
+        window.draw(batch);
         window.display();
     }
 
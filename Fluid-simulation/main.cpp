@@ -2,6 +2,7 @@
 #include <vector>
 #include <cmath>
 #include <random>
+#include "../circle-batch.h"
 
 class Particle {
     public:
@@ -44,6 +45,8 @@ int main() {
 
     }
 
+    CircleBatch batch;
+
     while (window.isOpen()) {
         sf::Event event;
         while (window.pollEvent(event)) {
@@ -123,14 +126,14 @@ int main() {
             particle.velocity.y += gravity;
 
             particle.position += particle.velocity;
+        }
 
-            // Draw
-            sf::CircleShape circleShape(particle.radius);
-            circleShape.setPosition(particle.position);
-            circleShape.setOrigin(sf::Vector2f(particle.radius, particle.radius));
-            circleShape.setFillColor(particle.color);
-            window.draw(circleShape);
+        // Draw
+        batch.resize(particles.size());
+        for (std::size_t i = 0; i < particles.size(); ++i) {
+            batch.set(i, particles[i].position, particles[i].radius, particles[i].color);
         }
+        window.draw(batch);
         window.display();
     }
 
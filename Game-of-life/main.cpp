@@ -6,42 +6,863 @@
 #include <algorithm>
 #include <array>
 #include <random>
+#include <cstdint>
+#include <limits>
+#include <cstring>
+#include <utility>
+#include <deque>
+#include <unordered_map>
 #include <omp.h>
 
-inline void setCellColor(sf::VertexArray& va, int x, int y, int width, int cellSize, sf::Color color) {
-    int i = (y * width + x) * 4;
-    sf::Vector2f pos(x * cellSize, y * cellSize);
+struct Rule {
+    int currentState;
+    int nextState;
+    int requiredNeighbors;
+    int neighborType;
+};
+
+const int stateCount = 5;
+// Padding around the grid. It's never counted as a neighbor, same as cells outside the grid before.
+const std::uint8_t absentState = 5;
+
+// The rules compiled into one dense table per state, indexed by the neighbor counts of the types
+// that state has rules for (count of the first type + 9 * count of the second + ...). The table holds
+// the result of the first rule that fires, so a cell costs the same no matter how many rules there are.
+struct CompiledRules {
+    static const std::uint16_t noMatch = std::numeric_limits<std::uint16_t>::max();
+
+    // Bit t is set if any rule looks at neighbors of type t
+    unsigned countedTypes;
+    std::uint32_t weight[stateCount][stateCount];
+    std::uint32_t offset[stateCount];
+    std::vector<std::uint8_t> table;
+
+    // Rules that only ever turn 0 and 1 into 0 and 1 are plain birth/survival rules on the amount
+    // of neighbors in state 1 (bit c is set if a cell with c such neighbors is 1 next generation)
+    bool binary;
+    std::uint16_t birth;
+    std::uint16_t survive;
+
+    CompiledRules(const std::vector<Rule>& rules = {}) {
+        compile(rules);
+    }
+
+    void compile(const std::vector<Rule>& rules) {
+        // firstMatch[state][type][count] is the index of the first rule that fires for a cell in state
+        // with count neighbors of type. The rule that applies to a cell is the smallest of these over all types.
+        std::uint16_t firstMatch[stateCount][stateCount][9];
+        for (auto &forState : firstMatch)
+            for (auto &forType : forState)
+                for (auto &index : forType)
+                    index = noMatch;
+
+        std::vector<std::uint8_t> nextState(rules.size(), 0);
+        for (std::size_t i = rules.size(); i-- > 0;) {
+            const Rule& r = rules[i];
+            // States, types and counts that can't occur never fire
+            if (r.currentState < 0 || r.currentState >= stateCount || r.neighborType < 0 || r.neighborType >= stateCount ||
+                r.requiredNeighbors < 0 || r.requiredNeighbors > 8 || r.nextState < 0 || r.nextState >= stateCount)
+                continue;
+            firstMatch[r.currentState][r.neighborType][r.requiredNeighbors] = std::min<std::size_t>(i, noMatch - 1);
+            nextState[i] = r.nextState;
+        }
+
+        countedTypes = 0;
+        table.clear();
+        for (int state = 0; state < stateCount; ++state) {
+            std::vector<int> types;
+            std::uint32_t size = 1;
+            for (int type = 0; type < stateCount; ++type) {
+                weight[state][type] = 0;
+                for (int count = 0; count <= 8; ++count) {
+                    if (firstMatch[state][type][count] != noMatch) {
+                        types.push_back(type);
+                        weight[state][type] = size;
+                        size *= 9;
+                        countedTypes |= 1u << type;
+                        break;
+                    }
+                }
+            }
+
+            offset[state] = table.size();
+            table.resize(table.size() + size);
+            for (std::uint32_t index = 0; index < size; ++index) {
+                std::uint16_t rule = noMatch;
+                for (int type : types)
+                    rule = std::min(rule, firstMatch[state][type][index / weight[state][type] % 9]);
+                table[offset[state] + index] = rule == noMatch ? state : nextState[rule];
+            }
+        }
+
+        binary = true;
+        birth = 0;
+        survive = 0;
+        for (int count = 0; count <= 8; ++count) {
+            std::uint8_t counts[stateCount] = {std::uint8_t(8 - count), std::uint8_t(count), 0, 0, 0};
+            std::uint8_t born = apply(0, counts);
+            std::uint8_t survives = apply(1, counts);
+            binary = binary && born <= 1 && survives <= 1;
+            birth |= born == 1 ? 1 << count : 0;
+            survive |= survives == 1 ? 1 << count : 0;
+        }
+    }
+
+    // Only the counts of the types in CountedTypes have to be filled in
+    template <unsigned CountedTypes = (1u << stateCount) - 1>
+    std::uint8_t apply(std::uint8_t state, const std::uint8_t counts[stateCount]) const {
+        std::uint32_t index = offset[state];
+        for (int type = 0; type < stateCount; ++type)
+            if (CountedTypes >> type & 1)
+                index += counts[type] * weight[state][type];
+        return table[index];
+    }
+};
+
+// One byte per cell, row-major, with a border of absentState so the neighbor loops need no bounds checks.
+// The grid is split into tiles of 64x64 cells, and only tiles that changed last generation, or are next
+// to one that did, get recomputed.
+class LifeGrid {
+    public:
+        static const int tileSize = 64;
+
+        int width;
+        int height;
+
+    LifeGrid(int width_, int height_) {
+        width = width_;
+        height = height_;
+        stride = width + 2;
+        words = (width + 63) / 64;
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+        cells.assign(stride * (height + 2), absentState);
+        next = cells;
+        bits.assign(words * (height + 2), 0);
+        nextBits = bits;
+        changed.assign(tilesX * tilesY, 1);
+        redraw.assign(tilesX * tilesY, 1);
+        highStates.assign(tilesX * tilesY, 0);
+        clear();
+    }
+
+    std::uint8_t get(int x, int y) const {
+        return cells[(y + 1) * stride + x + 1];
+    }
+
+    void set(int x, int y, std::uint8_t state) {
+        cells[(y + 1) * stride + x + 1] = state;
+        int tile = (y / tileSize) * tilesX + x / tileSize;
+        changed[tile] = 1;
+        redraw[tile] = 1;
+        highStates[tile] = highStates[tile] || state > 1;
+    }
+
+    void clear() {
+        for (int y = 0; y < height; ++y)
+            std::fill_n(&cells[(y + 1) * stride + 1], width, 0);
+        std::fill(highStates.begin(), highStates.end(), 0);
+        std::fill(changed.begin(), changed.end(), 1);
+        std::fill(redraw.begin(), redraw.end(), 1);
+    }
+
+    // Tiles that didn't change last generation are skipped, which only holds while the rules stay the same
+    void rulesChanged() {
+        std::fill(changed.begin(), changed.end(), 1);
+    }
+
+    void step(const CompiledRules& rules) {
+        static const std::array<ByteStepper, 1 << stateCount> byteSteppers = makeByteSteppers(std::make_index_sequence<1 << stateCount>());
+
+        activeTiles.clear();
+        for (int ty = 0; ty < tilesY; ++ty) {
+            for (int tx = 0; tx < tilesX; ++tx) {
+                bool active = false;
+                for (int ny = std::max(0, ty - 1); ny <= std::min(tilesY - 1, ty + 1); ++ny)
+                    for (int nx = std::max(0, tx - 1); nx <= std::min(tilesX - 1, tx + 1); ++nx)
+                        active = active || changed[ny * tilesX + nx];
+                if (active)
+                    activeTiles.push_back(ty * tilesX + tx);
+            }
+        }
+
+        if (rules.binary && onlyBinaryStates()) {
+            stepBits(rules);
+        } else {
+            (this->*byteSteppers[rules.countedTypes])(rules);
+            bitsValid = false;
+        }
+
+        // Every tile that wasn't recomputed holds the same cells in both buffers, so the swap is safe
+        std::fill(changed.begin(), changed.end(), 0);
+        int activeCount = activeTiles.size();
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < activeCount; ++i) {
+            int tile = activeTiles[i];
+            TileBounds t = tileBounds(tile);
+            bool differs = false;
+            for (int y = t.y0; y <= t.y1 && !differs; ++y)
+                differs = std::memcmp(&cells[y * stride + t.x0], &next[y * stride + t.x0], t.x1 - t.x0 + 1) != 0;
+            changed[tile] = differs;
+            redraw[tile] = redraw[tile] || differs;
+        }
+        std::swap(cells, next);
+    }
+
+    // Calls f(x0, y0, x1, y1) (exclusive end) for every tile that changed since the last call, in parallel
+    template <class F>
+    void forEachChangedTile(F f) {
+        std::vector<int> tiles;
+        for (int tile = 0; tile < tilesX * tilesY; ++tile) {
+            if (redraw[tile]) {
+                tiles.push_back(tile);
+                redraw[tile] = 0;
+            }
+        }
+
+        int tileCount = tiles.size();
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < tileCount; ++i) {
+            TileBounds t = tileBounds(tiles[i]);
+            f(t.x0 - 1, t.y0 - 1, t.x1, t.y1);
+        }
+    }
+
+    private:
+        // Inclusive cell range of a tile, in padded coordinates
+        struct TileBounds {
+            int x0, y0, x1, y1;
+            bool onBorder;
+        };
+
+        int stride;
+        int words;
+        int tilesX;
+        int tilesY;
+        bool bitsValid = false;
+        std::vector<std::uint8_t> cells;
+        std::vector<std::uint8_t> next;
+        std::vector<std::uint64_t> bits;
+        std::vector<std::uint64_t> nextBits;
+        // Per tile: changed last generation (or drawn on), and changed since the last redraw
+        std::vector<std::uint8_t> changed;
+        std::vector<std::uint8_t> redraw;
+        // Per tile: may hold states above 1, so the bit stepper can't be used
+        std::vector<std::uint8_t> highStates;
+        std::vector<int> activeTiles;
+
+    TileBounds tileBounds(int tile) const {
+        TileBounds t;
+        t.x0 = (tile % tilesX) * tileSize + 1;
+        t.y0 = (tile / tilesX) * tileSize + 1;
+        t.x1 = std::min(t.x0 + tileSize - 1, width);
+        t.y1 = std::min(t.y0 + tileSize - 1, height);
+        t.onBorder = t.x0 == 1 || t.y0 == 1 || t.x1 == width || t.y1 == height;
+        return t;
+    }
+
+    // Rescans the tiles that may hold states above 1, they can have been drawn over or died out since
+    bool onlyBinaryStates() {
+        int tileCount = tilesX * tilesY;
+        int highCount = 0;
+        #pragma omp parallel for schedule(dynamic) reduction(+:highCount)
+        for (int tile = 0; tile < tileCount; ++tile) {
+            if (!highStates[tile])
+                continue;
+            TileBounds t = tileBounds(tile);
+            bool high = false;
+            for (int y = t.y0; y <= t.y1 && !high; ++y)
+                for (int x = t.x0; x <= t.x1; ++x)
+                    high = high || cells[y * stride + x] > 1;
+            highStates[tile] = high;
+            highCount += high;
+        }
+        return highCount == 0;
+    }
+
+    // Per-state neighbor counts for a whole tile row: first the column sums of the three rows, then
+    // the sums of three columns minus the cell itself. Plain byte loops, so they vectorize.
+    // There's a version for every set of counted types, so states no rule looks at aren't counted.
+    template <unsigned CountedTypes>
+    void stepBytes(const CompiledRules& rules) {
+        int activeCount = activeTiles.size();
+        #pragma omp parallel
+        {
+            std::uint8_t columnSum[tileSize + 2];
+            std::uint8_t counts[stateCount][tileSize + 2];
+
+            #pragma omp for schedule(dynamic)
+            for (int i = 0; i < activeCount; ++i) {
+                TileBounds t = tileBounds(activeTiles[i]);
+                int tileWidth = t.x1 - t.x0 + 1;
+                std::uint8_t high = 0;
+
+                for (int y = t.y0; y <= t.y1; ++y) {
+                    const std::uint8_t* up = &cells[(y - 1) * stride + t.x0 - 1];
+                    const std::uint8_t* mid = &cells[y * stride + t.x0 - 1];
+                    const std::uint8_t* down = &cells[(y + 1) * stride + t.x0 - 1];
+
+                    for (int s = 0; s < stateCount; ++s) {
+                        if (!(CountedTypes >> s & 1))
+                            continue;
+                        std::uint8_t* count = counts[s];
+                        for (int x = 0; x < tileWidth + 2; ++x)
+                            columnSum[x] = (up[x] == s) + (mid[x] == s) + (down[x] == s);
+                        for (int x = 1; x <= tileWidth; ++x)
+                            count[x] = columnSum[x - 1] + columnSum[x] + columnSum[x + 1] - (mid[x] == s);
+                    }
+
+                    std::uint8_t* out = &next[y * stride + t.x0 - 1];
+                    for (int x = 1; x <= tileWidth; ++x) {
+                        std::uint8_t cellCounts[stateCount];
+                        for (int s = 0; s < stateCount; ++s)
+                            cellCounts[s] = CountedTypes >> s & 1 ? counts[s][x] : 0;
+                        out[x] = rules.apply<CountedTypes>(mid[x], cellCounts);
+                        high |= out[x] > 1;
+                    }
+                }
+                highStates[activeTiles[i]] = high;
+            }
+        }
+    }
+
+    // Same as stepBytes for a single cell, reading the neighbors directly
+    std::uint8_t stepCell(const CompiledRules& rules, int x, int y) const {
+        std::uint8_t cellCounts[stateCount] = {};
+        for (int j = -1; j <= 1; ++j) {
+            for (int i = -1; i <= 1; ++i) {
+                std::uint8_t s = cells[(y + j) * stride + x + i];
+                if ((i != 0 || j != 0) && s < stateCount)
+                    cellCounts[s]++;
+            }
+        }
+        return rules.apply(cells[y * stride + x], cellCounts);
+    }
+
+    // Packs one row of a tile, 64 cells per word
+    void packRow(int y, int word) {
+        const std::uint8_t* row = &cells[y * stride + 1];
+        std::uint64_t packed = 0;
+        int end = std::min(64, width - word * 64);
+        for (int x = 0; x < end; x += 8) {
+            // Eight cells at once, the multiply gathers the lowest bit of every byte into the top byte
+            std::uint64_t group = 0;
+            std::memcpy(&group, row + word * 64 + x, std::min(8, end - x));
+            packed |= ((group * 0x0102040810204080ull) >> 56) << x;
+        }
+        bits[y * words + word] = packed;
+    }
+
+    // A tile is one word wide. The eight neighbor bits of every cell are added with bit-sliced full
+    // adders into a 4 bit count, which picks the birth or survival bit.
+    void stepBits(const CompiledRules& rules) {
+        // The packed bits are kept between generations, only tiles that changed need packing again
+        int tileCount = tilesX * tilesY;
+        #pragma omp parallel for schedule(dynamic)
+        for (int tile = 0; tile < tileCount; ++tile) {
+            if (bitsValid && !changed[tile])
+                continue;
+            TileBounds t = tileBounds(tile);
+            for (int y = t.y0; y <= t.y1; ++y)
+                packRow(y, tile % tilesX);
+        }
+        bitsValid = true;
+
+        int activeCount = activeTiles.size();
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < activeCount; ++i) {
+            TileBounds t = tileBounds(activeTiles[i]);
+            int w = activeTiles[i] % tilesX;
+
+            for (int y = t.y0; y <= t.y1; ++y) {
+                std::uint64_t n[8];
+                int k = 0;
+                for (int r = y - 1; r <= y + 1; ++r) {
+                    const std::uint64_t* rowBits = &bits[r * words];
+                    std::uint64_t center = rowBits[w];
+                    std::uint64_t left = w > 0 ? rowBits[w - 1] : 0;
+                    std::uint64_t right = w + 1 < words ? rowBits[w + 1] : 0;
+                    n[k++] = (center << 1) | (left >> 63);
+                    n[k++] = (center >> 1) | (right << 63);
+                    if (r != y)
+                        n[k++] = center;
+                }
+
+                // Sum of the eight neighbor bits: bit0 + 2*bit1 + 4*bit2 + 8*bit3
+                std::uint64_t s0, c0, s1, c1, s2, c2, bit0, twos, sum, fours0, bit1, fours1;
+                fullAdd(n[0], n[1], n[2], s0, c0);
+                fullAdd(n[3], n[4], n[5], s1, c1);
+                s2 = n[6] ^ n[7];
+                c2 = n[6] & n[7];
+                fullAdd(s0, s1, s2, bit0, twos);
+                fullAdd(c0, c1, c2, sum, fours0);
+                bit1 = sum ^ twos;
+                fours1 = sum & twos;
+                std::uint64_t bit2 = fours0 ^ fours1;
+                std::uint64_t bit3 = fours0 & fours1;
+
+                std::uint64_t alive = bits[y * words + w];
+                std::uint64_t result = 0;
+                for (int count = 0; count <= 8; ++count) {
+                    std::uint64_t hasCount = (count & 1 ? bit0 : ~bit0) & (count & 2 ? bit1 : ~bit1) &
+                                             (count & 4 ? bit2 : ~bit2) & (count & 8 ? bit3 : ~bit3);
+                    if (rules.birth >> count & 1)
+                        result |= hasCount & ~alive;
+                    if (rules.survive >> count & 1)
+                        result |= hasCount & alive;
+                }
+
+                std::uint8_t* out = &next[y * stride + t.x0];
+                int tileWidth = t.x1 - t.x0 + 1;
+                for (int x = 0; x < tileWidth; x += 8) {
+                    // And back: copy the byte into every byte, keep bit k in byte k and turn it into a 0 or 1
+                    std::uint64_t group = (result >> x & 0xFF) * 0x0101010101010101ull;
+                    group = (((group & 0x8040201008040201ull) + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull;
+                    std::memcpy(out + x, &group, std::min(8, tileWidth - x));
+                }
+            }
+
+            // The bit counts treat cells outside the grid as dead cells, while they aren't counted at all,
+            // so cells on the border are redone the slow way
+            if (t.onBorder) {
+                for (int y = t.y0; y <= t.y1; ++y) {
+                    for (int x = t.x0; x <= t.x1; ++x) {
+                        if (x == 1 || y == 1 || x == width || y == height)
+                            next[y * stride + x] = stepCell(rules, x, y);
+                    }
+                }
+            }
+        }
+    }
+
+    typedef void (LifeGrid::*ByteStepper)(const CompiledRules&);
+
+    template <std::size_t... CountedTypes>
+    static constexpr std::array<ByteStepper, sizeof...(CountedTypes)> makeByteSteppers(std::index_sequence<CountedTypes...>) {
+        return {&LifeGrid::stepBytes<CountedTypes>...};
+    }
+
+    static void fullAdd(std::uint64_t a, std::uint64_t b, std::uint64_t c, std::uint64_t& sum, std::uint64_t& carry) {
+        std::uint64_t t = a ^ b;
+        sum = t ^ c;
+        carry = (a & b) | (t & c);
+    }
+};
+
+// Hashlife: the universe is a quadtree where equal squares are one shared node, and every node
+// remembers what its center looks like a power of two generations later. Patterns that repeat in
+// space or time are computed once, so sparse or periodic patterns can jump millions of generations.
+// Cells outside the finite grid are absentState, which never changes and is never counted, so a
+// background of absentState behaves exactly like the finite grid.
+class HashLife {
+    public:
+        std::uint64_t generation = 0;
+        // What all cells outside the stored squares are
+        std::uint8_t background;
+
+        // A step of 2^k generations leaves a root of level k + 3 around the origin, so store's
+        // coordinates reach 2^(k + 3) and have to stay within a signed 64 bit long
+        static constexpr int maxLog2Generations = 59;
+
+    HashLife(const CompiledRules& rules_, std::uint8_t background_) {
+        rules = rules_;
+        background = background_;
+        createLeaves();
+        root = uniform(3, background);
+    }
+
+    std::size_t nodeCount() const {
+        return nodes.size();
+    }
+
+    // The grid goes to [0, width) x [0, height), everything else is background
+    void load(const LifeGrid& grid) {
+        int level = 3;
+        while ((1 << (level - 1)) < std::max(grid.width, grid.height))
+            ++level;
+        long half = 1l << (level - 1);
+        root = build(grid, level, -half, -half);
+    }
+
+    // Writes the cells in [0, width) x [0, height) back into the grid
+    void store(LifeGrid& grid) const {
+        long half = 1l << (root->level - 1);
+        write(grid, root, -half, -half);
+    }
 
-    va[i + 0].position = pos;
-    va[i + 1].position = pos + sf::Vector2f(cellSize, 0);
-    va[i + 2].position = pos + sf::Vector2f(cellSize, cellSize);
-    va[i + 3].position = pos + sf::Vector2f(0, cellSize);
+    // Advances 2^log2Generations generations, at most 2^maxLog2Generations
+    void step(int log2Generations) {
+        while (root->level < log2Generations + 3 || !surroundedByBackground(root))
+            expand();
+        // One more so the pattern can't grow out of the center that the result covers
+        expand();
 
-    va[i + 0].color = color;
-    va[i + 1].color = color;
-    va[i + 2].color = color;
-    va[i + 3].color = color;
+        root = successor(root, log2Generations);
+        std::uint64_t generations = 1ull << log2Generations;
+        generation += generations;
+        background = advanceBackground(background, generations);
+
+        if (nodes.size() > maxNodes)
+            collect();
+    }
+
+    private:
+        struct Node {
+            Node* nw;
+            Node* ne;
+            Node* sw;
+            Node* se;
+            // Center of the node 2^resultStep generations later
+            Node* result;
+            int resultStep;
+            int level;
+            std::uint8_t state;
+        };
+
+        struct NodeKey {
+            Node* nw;
+            Node* ne;
+            Node* sw;
+            Node* se;
+
+            bool operator==(const NodeKey& other) const {
+                return nw == other.nw && ne == other.ne && sw == other.sw && se == other.se;
+            }
+        };
+
+        struct NodeKeyHash {
+            std::size_t operator()(const NodeKey& key) const {
+                std::size_t hash = reinterpret_cast<std::uintptr_t>(key.nw);
+                hash = hash * 31 + reinterpret_cast<std::uintptr_t>(key.ne);
+                hash = hash * 31 + reinterpret_cast<std::uintptr_t>(key.sw);
+                hash = hash * 31 + reinterpret_cast<std::uintptr_t>(key.se);
+                return hash ^ (hash >> 17);
+            }
+        };
+
+        static const std::size_t maxNodes = 4000000;
+
+        CompiledRules rules;
+        Node* root;
+        // A deque never moves its elements, so the nodes can point at each other
+        std::deque<Node> nodes;
+        std::unordered_map<NodeKey, Node*, NodeKeyHash> table;
+        Node* leaves[stateCount + 1];
+        std::vector<Node*> uniforms[stateCount + 1];
+
+    void createLeaves() {
+        for (int state = 0; state <= stateCount; ++state) {
+            nodes.push_back({nullptr, nullptr, nullptr, nullptr, nullptr, -1, 0, std::uint8_t(state)});
+            leaves[state] = &nodes.back();
+            uniforms[state] = {leaves[state]};
+        }
+    }
+
+    Node* join(Node* nw, Node* ne, Node* sw, Node* se) {
+        NodeKey key{nw, ne, sw, se};
+        auto found = table.find(key);
+        if (found != table.end())
+            return found->second;
+
+        nodes.push_back({nw, ne, sw, se, nullptr, -1, nw->level + 1, 0});
+        table.emplace(key, &nodes.back());
+        return &nodes.back();
+    }
+
+    Node* uniform(int level, std::uint8_t state) {
+        std::vector<Node*>& sizes = uniforms[state];
+        while ((int)sizes.size() <= level) {
+            Node* smaller = sizes.back();
+            sizes.push_back(join(smaller, smaller, smaller, smaller));
+        }
+        return sizes[level];
+    }
+
+    Node* center(Node* node) {
+        return join(node->nw->se, node->ne->sw, node->sw->ne, node->se->nw);
+    }
+
+    bool surroundedByBackground(Node* node) {
+        Node* empty = uniform(node->level - 2, background);
+        return node->nw->nw == empty && node->nw->ne == empty && node->nw->sw == empty &&
+               node->ne->nw == empty && node->ne->ne == empty && node->ne->se == empty &&
+               node->sw->nw == empty && node->sw->sw == empty && node->sw->se == empty &&
+               node->se->ne == empty && node->se->sw == empty && node->se->se == empty;
+    }
+
+    // Doubles the size of the root, the old root ends up in the middle
+    void expand() {
+        Node* empty = uniform(root->level - 1, background);
+        root = join(join(empty, empty, empty, root->nw), join(empty, empty, root->ne, empty),
+                    join(empty, root->sw, empty, empty), join(root->se, empty, empty, empty));
+    }
+
+    // Center of a level 2 node (4x4 cells) one generation later
+    Node* stepCenter(Node* node) {
+        std::uint8_t cells[4][4];
+        Node* quarters[2][2] = {{node->nw, node->ne}, {node->sw, node->se}};
+        for (int qy = 0; qy < 2; ++qy) {
+            for (int qx = 0; qx < 2; ++qx) {
+                Node* quarter = quarters[qy][qx];
+                cells[qy * 2][qx * 2] = quarter->nw->state;
+                cells[qy * 2][qx * 2 + 1] = quarter->ne->state;
+                cells[qy * 2 + 1][qx * 2] = quarter->sw->state;
+                cells[qy * 2 + 1][qx * 2 + 1] = quarter->se->state;
+            }
+        }
+
+        Node* result[2][2];
+        for (int y = 1; y <= 2; ++y) {
+            for (int x = 1; x <= 2; ++x) {
+                std::uint8_t state = cells[y][x];
+                if (state == absentState) {
+                    result[y - 1][x - 1] = leaves[absentState];
+                    continue;
+                }
+                std::uint8_t counts[stateCount] = {};
+                for (int j = -1; j <= 1; ++j)
+                    for (int i = -1; i <= 1; ++i)
+                        if ((i != 0 || j != 0) && cells[y + j][x + i] < stateCount)
+                            counts[cells[y + j][x + i]]++;
+                result[y - 1][x - 1] = leaves[rules.apply(state, counts)];
+            }
+        }
+        return join(result[0][0], result[0][1], result[1][0], result[1][1]);
+    }
+
+    // Center of a node (half its size) 2^log2Generations generations later, needs log2Generations <= level - 2
+    Node* successor(Node* node, int log2Generations) {
+        if (node->result != nullptr && node->resultStep == log2Generations)
+            return node->result;
+
+        Node* result;
+        if (node->level == 2) {
+            result = stepCenter(node);
+        } else {
+            Node* a = node->nw;
+            Node* b = node->ne;
+            Node* c = node->sw;
+            Node* d = node->se;
+            // The nine overlapping squares of half the size
+            Node* parts[3][3] = {
+                {a, join(a->ne, b->nw, a->se, b->sw), b},
+                {join(a->sw, a->se, c->nw, c->ne), join(a->se, b->sw, c->ne, d->nw), join(b->sw, b->se, d->nw, d->ne)},
+                {c, join(c->ne, d->nw, c->se, d->sw), d}
+            };
+
+            // Full step: both halves of the time advance by a recursive step. Smaller steps only
+            // advance in the second half and take the plain centers in the first.
+            bool fullStep = log2Generations == node->level - 2;
+            int halfStep = fullStep ? log2Generations - 1 : log2Generations;
+            Node* moved[3][3];
+            for (int y = 0; y < 3; ++y)
+                for (int x = 0; x < 3; ++x)
+                    moved[y][x] = fullStep ? successor(parts[y][x], halfStep) : center(parts[y][x]);
+
+            Node* quarters[2][2];
+            for (int y = 0; y < 2; ++y)
+                for (int x = 0; x < 2; ++x)
+                    quarters[y][x] = successor(join(moved[y][x], moved[y][x + 1], moved[y + 1][x], moved[y + 1][x + 1]), halfStep);
+            result = join(quarters[0][0], quarters[0][1], quarters[1][0], quarters[1][1]);
+        }
+
+        node->result = result;
+        node->resultStep = log2Generations;
+        return result;
+    }
+
+    // A uniform universe stays uniform, and runs into a cycle within stateCount generations
+    std::uint8_t advanceBackground(std::uint8_t state, std::uint64_t generations) {
+        std::vector<std::uint8_t> sequence;
+        while (generations > 0) {
+            auto seen = std::find(sequence.begin(), sequence.end(), state);
+            if (seen != sequence.end()) {
+                std::uint64_t period = sequence.end() - seen;
+                return *(seen + generations % period);
+            }
+            sequence.push_back(state);
+            if (state != absentState) {
+                std::uint8_t counts[stateCount] = {};
+                counts[state] = 8;
+                state = rules.apply(state, counts);
+            }
+            --generations;
+        }
+        return state;
+    }
+
+    Node* build(const LifeGrid& grid, int level, long x0, long y0) {
+        long size = 1l << level;
+        if (x0 >= grid.width || y0 >= grid.height || x0 + size <= 0 || y0 + size <= 0)
+            return uniform(level, background);
+        if (level == 0)
+            return leaves[grid.get(x0, y0)];
+
+        long half = size / 2;
+        return join(build(grid, level - 1, x0, y0), build(grid, level - 1, x0 + half, y0),
+                    build(grid, level - 1, x0, y0 + half), build(grid, level - 1, x0 + half, y0 + half));
+    }
+
+    void write(LifeGrid& grid, Node* node, long x0, long y0) const {
+        long size = 1l << node->level;
+        if (x0 >= grid.width || y0 >= grid.height || x0 + size <= 0 || y0 + size <= 0)
+            return;
+        if (node->level == 0) {
+            grid.set(x0, y0, node->state);
+            return;
+        }
+
+        long half = size / 2;
+        write(grid, node->nw, x0, y0);
+        write(grid, node->ne, x0 + half, y0);
+        write(grid, node->sw, x0, y0 + half);
+        write(grid, node->se, x0 + half, y0 + half);
+    }
+
+    // Drops every node the root doesn't use anymore, along with all remembered results
+    void collect() {
+        std::deque<Node> oldNodes;
+        oldNodes.swap(nodes);
+        table.clear();
+        createLeaves();
+
+        std::unordered_map<Node*, Node*> copies;
+        root = copy(root, copies);
+    }
+
+    Node* copy(Node* node, std::unordered_map<Node*, Node*>& copies) {
+        if (node->level == 0)
+            return leaves[node->state];
+        auto found = copies.find(node);
+        if (found != copies.end())
+            return found->second;
+
+        Node* copied = join(copy(node->nw, copies), copy(node->ne, copies), copy(node->sw, copies), copy(node->se, copies));
+        copies.emplace(node, copied);
+        return copied;
+    }
+};
+
+// Draws the grid as a texture with one texel per cell, scaled up to the cell size by a sprite.
+// Only the part of every row that changed gets uploaded.
+class GridRenderer : public sf::Drawable {
+    public:
+        std::array<sf::Color, stateCount> palette = {sf::Color::Black, sf::Color::White, sf::Color::Red, sf::Color::Blue, sf::Color::Green};
+
+    GridRenderer(int width_, int height_, int cellSize) {
+        width = width_;
+        height = height_;
+        tilesX = (width + LifeGrid::tileSize - 1) / LifeGrid::tileSize;
+
+        shown.assign(width * height, 0);
+        pixels.resize(width * height * 4);
+        for (int i = 0; i < width * height; ++i)
+            setPixel(i, 0);
+        spanStart.assign(tilesX * height, width);
+        spanEnd.assign(tilesX * height, 0);
+
+        texture.create(width, height);
+        texture.update(pixels.data());
+        sprite.setTexture(texture);
+        sprite.setScale(cellSize, cellSize);
+    }
+
+    void update(LifeGrid& grid) {
+        // Find the changed span of every row of every changed tile, in parallel
+        grid.forEachChangedTile([&](int x0, int y0, int x1, int y1) {
+            int tile = x0 / LifeGrid::tileSize;
+            for (int y = y0; y < y1; ++y) {
+                int start = x1;
+                int end = x0;
+                for (int x = x0; x < x1; ++x) {
+                    std::uint8_t state = grid.get(x, y);
+                    if (state != shown[y * width + x]) {
+                        shown[y * width + x] = state;
+                        setPixel(y * width + x, state);
+                        start = std::min(start, x);
+                        end = x + 1;
+                    }
+                }
+                spanStart[tile * height + y] = start;
+                spanEnd[tile * height + y] = end;
+            }
+        });
+
+        // One upload per row, covering the spans of all its tiles
+        for (int y = 0; y < height; ++y) {
+            int start = width;
+            int end = 0;
+            for (int tile = 0; tile < tilesX; ++tile) {
+                int i = tile * height + y;
+                if (spanStart[i] < spanEnd[i]) {
+                    start = std::min(start, spanStart[i]);
+                    end = std::max(end, spanEnd[i]);
+                }
+                spanStart[i] = width;
+                spanEnd[i] = 0;
+            }
+            if (start < end)
+                texture.update(&pixels[(y * width + start) * 4], end - start, 1, start, y);
+        }
+    }
+
+    private:
+        int width;
+        int height;
+        int tilesX;
+        // The state each texel shows, one byte per cell
+        std::vector<std::uint8_t> shown;
+        std::vector<sf::Uint8> pixels;
+        std::vector<int> spanStart;
+        std::vector<int> spanEnd;
+        sf::Texture texture;
+        sf::Sprite sprite;
+
+    void setPixel(int i, std::uint8_t state) {
+        sf::Color color = palette[state];
+        pixels[i * 4 + 0] = color.r;
+        pixels[i * 4 + 1] = color.g;
+        pixels[i * 4 + 2] = color.b;
+        pixels[i * 4 + 3] = color.a;
+    }
+
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        target.draw(sprite, states);
+    }
+};
+
+// Asks for k and moves the grid 2^k generations ahead with Hashlife
+void hashlifeJump(LifeGrid& grid, const CompiledRules& rules) {
+    int log2Generations;
+    std::cout << "jump 2^k generations, k: ";
+    std::cin >> log2Generations;
+
+    int finite;
+    std::cout << "finite grid (1) or infinite universe of state 0 (0): ";
+    std::cin >> finite;
+
+    sf::Clock clock;
+    HashLife life(rules, finite ? absentState : 0);
+    life.load(grid);
+    if (log2Generations > HashLife::maxLog2Generations)
+        std::cout << "k is at most " << HashLife::maxLog2Generations << "\n";
+    life.step(std::clamp(log2Generations, 0, HashLife::maxLog2Generations));
+    life.store(grid);
+    std::cout << "jumped " << life.generation << " generations in " << clock.getElapsedTime().asSeconds()
+              << "s (" << life.nodeCount() << " nodes)\n";
 }
 
-void Draw(std::vector<std::vector<int>>& cells, const sf::Vector2i& pos, int radius,
-          int state, int width, int height) {
+void Draw(LifeGrid& cells, const sf::Vector2i& pos, int radius, int state) {
     const int xmin = std::max(0, pos.x - radius);
-    const int xmax = std::min(width - 1, pos.x + radius);
+    const int xmax = std::min(cells.width - 1, pos.x + radius);
     const int ymin = std::max(0, pos.y - radius);
-    const int ymax = std::min(height - 1, pos.y + radius);
+    const int ymax = std::min(cells.height - 1, pos.y + radius);
 
     for (int x = xmin; x <= xmax; ++x)
         for (int y = ymin; y <= ymax; ++y)
-            cells[x][y] = state;
+            cells.set(x, y, state);
 }
 
-struct Rule {
-    int currentState;
-    int nextState;
-    int requiredNeighbors;
-    int neighborType;
-};
-
 void readRules(std::vector<Rule>& rules, std::mt19937& gen) {
     std::string line;
 
@@ -126,17 +947,17 @@ int main() {
 //    std::cout << "pixel size: ";
 //    std::cin >> cellSize;
 
-    std::vector<std::vector<int>> cellStates(width, std::vector<int>(height, 0));
-    std::vector<std::vector<int>> newStates(width, std::vector<int>(height, 0));
+    LifeGrid cellStates(width, height);
 
     readRules(rules, gen);
+    CompiledRules compiledRules(rules);
 
     
     sf::RenderWindow window(
         sf::VideoMode({width * cellSize, height * cellSize}), "game of life (with silly twist)");
     window.setFramerateLimit(60);
 
-    sf::VertexArray grid(sf::Quads, width * height * 4);
+    GridRenderer renderer(width, height, cellSize);
 
     while (window.isOpen()) {
         sf::Vector2f windowMousePos =
@@ -158,73 +979,34 @@ int main() {
 
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::R)) {
             readRules(rules, gen);
+            compiledRules.compile(rules);
+            cellStates.rulesChanged();
+        }
+
+        if (sf::Keyboard::isKeyPressed(sf::Keyboard::H)) {
+            hashlifeJump(cellStates, compiledRules);
         }
 
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::Y))
-            Draw(cellStates, hoveredPixel, 50, 0, width, height);
+            Draw(cellStates, hoveredPixel, 50, 0);
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::U))
-            Draw(cellStates, hoveredPixel, 2, 1, width, height);
+            Draw(cellStates, hoveredPixel, 2, 1);
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::I))
-            Draw(cellStates, hoveredPixel, 2, 2, width, height);
+            Draw(cellStates, hoveredPixel, 2, 2);
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::O))
-            Draw(cellStates, hoveredPixel, 2, 3, width, height);
+            Draw(cellStates, hoveredPixel, 2, 3);
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::P))
-            Draw(cellStates, hoveredPixel, 2, 4, width, height);
+            Draw(cellStates, hoveredPixel, 2, 4);
 
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::C)) {
-            cellStates = std::vector<std::vector<int>>(width, std::vector<int>(height, 0));
-            newStates = std::vector<std::vector<int>>(width, std::vector<int>(height, 0));
+            cellStates.clear();
         }
 
-        #pragma omp parallel for collapse(2)
-        for (int x = 0; x < width; ++x) {
-            for (int y = 0; y < height; ++y) {
-                std::array<int, 5> neighborCounts{}; // states 0–4
-
-                for (int i = -1; i <= 1; ++i) {
-                    for (int j = -1; j <= 1; ++j) {
-                        if (i == 0 && j == 0) continue;
-
-                        int nx = x + i, ny = y + j;
-                        if (nx < 0 || nx >= width || ny < 0 || ny >= height)
-                            continue;
-
-                        int s = cellStates[nx][ny];
-                        if (s >= 0 && s <= 4)
-                            neighborCounts[s]++;
-                    }
-                }
-
-                int currentState = cellStates[x][y];
-                int newState = currentState;
-
-                // Apply rules
-                for (const Rule& r : rules) {
-                    if (currentState == r.currentState &&
-                        neighborCounts[r.neighborType] == r.requiredNeighbors) {
-                        newState = r.nextState;
-                        break;
-                    }
-                }
-
-                // Choose color
-                sf::Color c = sf::Color::Black;
-                switch (newState) {
-                    case 1: c = sf::Color::White; break;
-                    case 2: c = sf::Color::Red;   break;
-                    case 3: c = sf::Color::Blue;  break;
-                    case 4: c = sf::Color::Green; break;
-                }
-
-                setCellColor(grid, x, y, width, cellSize, c);
-                newStates[x][y] = newState;
-            }
-        }
+        cellStates.step(compiledRules);
 
-        // Swap buffers
-        std::swap(cellStates, newStates);
+        renderer.update(cellStates);
 
-        window.draw(grid);
+        window.draw(renderer);
         window.display();
     }
 
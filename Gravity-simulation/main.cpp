@@ -2,6 +2,11 @@
 #include <iostream>
 #include <vector>
 #include <cmath>
+#include <random>
+#include <array>
+#include <algorithm>
+#include <omp.h>
+#include "../circle-batch.h"
 
 class GravityObject {
     public:
@@ -26,8 +31,8 @@ float magnitude(sf::Vector2f v) {
     return std::sqrt(v.x * v.x + v.y * v.y);
 }
 
-sf::Vector2f gravitationalAcceleration(GravityObject obj1, GravityObject obj2, float G) {
-    sf::Vector2f direction = obj2.position - obj1.position;
+sf::Vector2f gravitationalAcceleration(sf::Vector2f position, sf::Vector2f otherPosition, float otherMass, float G) {
+    sf::Vector2f direction = otherPosition - position;
     float distance = magnitude(direction);
 
 
@@ -36,10 +41,356 @@ sf::Vector2f gravitationalAcceleration(GravityObject obj1, GravityObject obj2, f
     }
 
     sf::Vector2f normalizedDirection(direction.x / distance, direction.y / distance);
-    float scalar = G * obj2.mass / (distance * distance);
+    float scalar = G * otherMass / (distance * distance);
     return sf::Vector2f(normalizedDirection.x * scalar, normalizedDirection.y * scalar);
 }
 
+sf::Vector2f gravitationalAcceleration(const GravityObject& obj1, const GravityObject& obj2, float G) {
+    return gravitationalAcceleration(obj1.position, obj2.position, obj2.mass, G);
+}
+
+// Potential energy per unit mass, flat below distance 3 where the force is switched off
+double gravitationalPotential(sf::Vector2f position, sf::Vector2f otherPosition, float otherMass, float G) {
+    double distance = std::max(magnitude(otherPosition - position), 3.0f);
+    return -G * otherMass / distance;
+}
+
+// Barnes-Hut quadtree. Every node knows the total mass and the center of mass of the bodies below it,
+// so a node that looks small enough from a body (size / distance < theta) can stand in for all of them.
+class QuadTree {
+    public:
+        struct Node {
+            sf::Vector2f center; // center of the square this node covers
+            float halfSize;
+            float mass;
+            sf::Vector2f centerOfMass;
+            int firstChild; // the 4 children are stored next to each other, -1 for a leaf
+            int body;       // body in a leaf with exactly one body, -1 otherwise
+        };
+
+        std::vector<Node> nodes;
+
+    void build(const std::vector<GravityObject>& objects) {
+        nodes.clear();
+        if (objects.empty()) {
+            return;
+        }
+
+        sf::Vector2f minimum = objects[0].position;
+        sf::Vector2f maximum = objects[0].position;
+        for (const GravityObject &obj : objects) {
+            minimum.x = std::min(minimum.x, obj.position.x);
+            minimum.y = std::min(minimum.y, obj.position.y);
+            maximum.x = std::max(maximum.x, obj.position.x);
+            maximum.y = std::max(maximum.y, obj.position.y);
+        }
+        float halfSize = std::max(maximum.x - minimum.x, maximum.y - minimum.y) / 2.0f + 1.0f;
+        nodes.push_back(makeNode((minimum + maximum) / 2.0f, halfSize));
+
+        for (int i = 0; i < (int)objects.size(); ++i) {
+            insert(objects, i);
+        }
+
+        // The nodes summed mass * position on the way down
+        for (Node &node : nodes) {
+            if (node.mass > 0) {
+                node.centerOfMass /= node.mass;
+            }
+        }
+    }
+
+    // Calls f(centerOfMass, mass) for every node (or single body) that acts on body
+    template <typename Function>
+    void walk(const std::vector<GravityObject>& objects, int body, float theta, Function f) const {
+        if (nodes.empty()) {
+            return;
+        }
+        const sf::Vector2f position = objects[body].position;
+
+        std::array<int, 4 * maxDepth + 4> stack;
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+
+        while (stackSize > 0) {
+            const Node &node = nodes[stack[--stackSize]];
+            if (node.mass == 0 || node.body == body) {
+                continue;
+            }
+
+            if (node.firstChild == -1) {
+                f(node.centerOfMass, node.mass);
+                continue;
+            }
+
+            float distance = magnitude(node.centerOfMass - position);
+            if (2.0f * node.halfSize < theta * distance) {
+                f(node.centerOfMass, node.mass);
+            }
+            else {
+                for (int k = 0; k < 4; ++k) {
+                    stack[stackSize++] = node.firstChild + k;
+                }
+            }
+        }
+    }
+
+    sf::Vector2f acceleration(const std::vector<GravityObject>& objects, int body, float G, float theta) const {
+        sf::Vector2f total(0, 0);
+        walk(objects, body, theta, [&](sf::Vector2f centerOfMass, float mass) {
+            total += gravitationalAcceleration(objects[body].position, centerOfMass, mass, G);
+        });
+        return total;
+    }
+
+    double potential(const std::vector<GravityObject>& objects, int body, float G, float theta) const {
+        double total = 0;
+        walk(objects, body, theta, [&](sf::Vector2f centerOfMass, float mass) {
+            total += gravitationalPotential(objects[body].position, centerOfMass, mass, G);
+        });
+        return total;
+    }
+
+    private:
+        // Bodies closer together than the cells at this depth share one leaf
+        static const int maxDepth = 32;
+
+    static Node makeNode(sf::Vector2f center, float halfSize) {
+        return Node{center, halfSize, 0.0f, sf::Vector2f(0, 0), -1, -1};
+    }
+
+    static int quadrant(const Node& node, sf::Vector2f position) {
+        return (position.x >= node.center.x ? 1 : 0) + (position.y >= node.center.y ? 2 : 0);
+    }
+
+    void subdivide(int index) {
+        int firstChild = nodes.size();
+        float quarter = nodes[index].halfSize / 2.0f;
+        sf::Vector2f center = nodes[index].center;
+        nodes.push_back(makeNode(center + sf::Vector2f(-quarter, -quarter), quarter));
+        nodes.push_back(makeNode(center + sf::Vector2f( quarter, -quarter), quarter));
+        nodes.push_back(makeNode(center + sf::Vector2f(-quarter,  quarter), quarter));
+        nodes.push_back(makeNode(center + sf::Vector2f( quarter,  quarter), quarter));
+        nodes[index].firstChild = firstChild;
+    }
+
+    void insert(const std::vector<GravityObject>& objects, int body) {
+        const GravityObject &obj = objects[body];
+        int index = 0;
+
+        for (int depth = 0; ; ++depth) {
+            bool wasEmpty = nodes[index].mass == 0;
+            nodes[index].mass += obj.mass;
+            nodes[index].centerOfMass += obj.position * obj.mass;
+
+            if (nodes[index].firstChild != -1) {
+                index = nodes[index].firstChild + quadrant(nodes[index], obj.position);
+                continue;
+            }
+            if (wasEmpty) {
+                nodes[index].body = body;
+                return;
+            }
+            if (depth == maxDepth) {
+                nodes[index].body = -1;
+                return;
+            }
+
+            // Occupied leaf, push the body that was here one level down and try again
+            int previous = nodes[index].body;
+            subdivide(index);
+            nodes[index].body = -1;
+            if (previous != -1) {
+                const GravityObject &other = objects[previous];
+                Node &child = nodes[nodes[index].firstChild + quadrant(nodes[index], other.position)];
+                child.mass = other.mass;
+                child.centerOfMass = other.position * other.mass;
+                child.body = previous;
+            }
+            index = nodes[index].firstChild + quadrant(nodes[index], obj.position);
+        }
+    }
+};
+
+// Acceleration of every body, either from the exact sum over all pairs or from the Barnes-Hut tree
+void computeAccelerations(const std::vector<GravityObject>& objects, std::vector<sf::Vector2f>& accelerations,
+                          QuadTree& tree, bool useBarnesHut, float G, float theta) {
+    int count = objects.size();
+    accelerations.assign(count, sf::Vector2f(0, 0));
+
+    if (useBarnesHut) {
+        tree.build(objects);
+    }
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < count; ++i) {
+        if (useBarnesHut) {
+            accelerations[i] = tree.acceleration(objects, i, G, theta);
+            continue;
+        }
+        for (int j = 0; j < count; ++j) {
+            if (i == j) {
+                continue;
+            }
+            accelerations[i] += gravitationalAcceleration(objects[i], objects[j], G);
+        }
+    }
+}
+
+enum Integrator {
+    SymplecticEuler, // what the simulation always did: kick, then drift
+    Leapfrog,        // drift-kick-drift, the same trajectory as velocity Verlet
+    Yoshida4,        // three leapfrog steps with Yoshida's weights, 4th order
+    IntegratorCount
+};
+
+const char* integratorName(Integrator integrator) {
+    switch (integrator) {
+        case SymplecticEuler: return "symplectic Euler";
+        case Leapfrog: return "leapfrog";
+        case Yoshida4: return "Yoshida 4th order";
+        default: return "?";
+    }
+}
+
+// Advances the bodies with a fixed timestep, independent of the frame rate. Real time passed since the
+// last frame is turned into simulated time and used up in steps of 1 / subSteps, whatever doesn't make a
+// whole step carries over to the next frame.
+class PhysicsStepper {
+    public:
+        Integrator integrator;
+        int subSteps;
+        // Simulated time per real second, 60 keeps the old speed of dt = 1 per frame at 60 fps
+        float timeScale;
+        // The most simulated time one frame may catch up on, so a slow frame can't snowball into slower ones
+        float maxFrameTime;
+
+        float G;
+        bool useBarnesHut;
+        float theta;
+
+        QuadTree tree;
+        std::vector<sf::Vector2f> accelerations;
+
+    PhysicsStepper(float G_) {
+        integrator = Leapfrog;
+        subSteps = 1;
+        timeScale = 60.0f;
+        maxFrameTime = 4.0f;
+        G = G_;
+        useBarnesHut = false;
+        theta = 0.5f;
+    }
+
+    void advanceFrame(std::vector<GravityObject>& objects, float elapsedSeconds) {
+        float dt = 1.0f / subSteps;
+        accumulatedTime = std::min(accumulatedTime + elapsedSeconds * timeScale, maxFrameTime);
+        while (accumulatedTime >= dt) {
+            step(objects, dt);
+            accumulatedTime -= dt;
+        }
+    }
+
+    void step(std::vector<GravityObject>& objects, float dt) {
+        switch (integrator) {
+            case SymplecticEuler:
+                kick(objects, dt);
+                drift(objects, dt);
+                break;
+            case Leapfrog:
+                leapfrog(objects, dt);
+                break;
+            case Yoshida4: {
+                const double cubeRootTwo = std::cbrt(2.0);
+                const double w1 = 1.0 / (2.0 - cubeRootTwo);
+                const double w0 = -cubeRootTwo / (2.0 - cubeRootTwo);
+                leapfrog(objects, w1 * dt);
+                leapfrog(objects, w0 * dt);
+                leapfrog(objects, w1 * dt);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Kinetic plus potential energy, the potential goes through the tree in Barnes-Hut mode
+    double energy(const std::vector<GravityObject>& objects) {
+        int count = objects.size();
+        if (useBarnesHut) {
+            tree.build(objects);
+        }
+
+        double total = 0;
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:total)
+        for (int i = 0; i < count; ++i) {
+            const GravityObject &obj = objects[i];
+            double potential = 0;
+            if (useBarnesHut) {
+                potential = tree.potential(objects, i, G, theta);
+            }
+            else {
+                for (int j = 0; j < count; ++j) {
+                    if (i != j) {
+                        potential += gravitationalPotential(obj.position, objects[j].position, objects[j].mass, G);
+                    }
+                }
+            }
+            // Every pair shows up twice in the potential
+            total += 0.5 * obj.mass * (obj.velocity.x * obj.velocity.x + obj.velocity.y * obj.velocity.y)
+                   + 0.5 * obj.mass * potential;
+        }
+        return total;
+    }
+
+    private:
+        float accumulatedTime = 0;
+
+    void leapfrog(std::vector<GravityObject>& objects, float h) {
+        drift(objects, 0.5f * h);
+        kick(objects, h);
+        drift(objects, 0.5f * h);
+    }
+
+    void drift(std::vector<GravityObject>& objects, float h) {
+        #pragma omp parallel for
+        for (int i = 0; i < (int)objects.size(); ++i) {
+            objects[i].position += objects[i].velocity * h;
+        }
+    }
+
+    // Grabbed bodies keep the velocity the mouse gave them
+    void kick(std::vector<GravityObject>& objects, float h) {
+        computeAccelerations(objects, accelerations, tree, useBarnesHut, G, theta);
+
+        #pragma omp parallel for
+        for (int i = 0; i < (int)objects.size(); ++i) {
+            if (!objects[i].isGrabbed) {
+                objects[i].velocity += accelerations[i] * h;
+            }
+        }
+    }
+};
+
+// A disc of small bodies around center, on roughly circular orbits around the disc's own mass
+void spawnGalaxy(std::vector<GravityObject>& objects, sf::Vector2f center, int count, float discRadius, float G, std::mt19937& gen) {
+    std::uniform_real_distribution<float> rand01(0.0f, 1.0f);
+    float totalMass = count;
+
+    for (int i = 0; i < count; ++i) {
+        float r = discRadius * std::sqrt(rand01(gen));
+        float angle = 2.0f * M_PI * rand01(gen);
+
+        GravityObject obj;
+        obj.radius = 2;
+        obj.position = center + sf::Vector2f(std::cos(angle), std::sin(angle)) * r;
+
+        float enclosedMass = totalMass * (r * r) / (discRadius * discRadius);
+        float speed = std::sqrt(G * enclosedMass / std::max(r, 3.0f));
+        obj.velocity = sf::Vector2f(-std::sin(angle), std::cos(angle)) * speed;
+        objects.push_back(obj);
+    }
+}
+
 int main() {
     // Initialize window
     sf::RenderWindow window(sf::VideoMode(1600, 900), "Gravity Simulation");
@@ -50,6 +401,23 @@ int main() {
     sf::Vector2i mousePosition;
 
     int scrollSpeed = 30;
+    float G = 10000;
+
+    // B switches between the exact pairwise sum and Barnes-Hut, [ and ] change the opening angle,
+    // I cycles through the integrators, + and - change the sub-steps per time unit
+    PhysicsStepper stepper(G);
+
+    // Energy drift relative to the energy at the last change (new bodies, grabbing, settings), printed every second
+    double referenceEnergy = 0;
+    bool energyIsStale = true;
+    int framesSinceReport = 0;
+
+    // G spawns this many small bodies at the mouse
+    int galaxySize = 10000;
+    std::mt19937 gen(std::random_device{}());
+
+    CircleBatch batch;
+    sf::Clock frameClock;
 
     // Loop
     while (window.isOpen()) {
@@ -61,26 +429,62 @@ int main() {
                 window.close();
             }
             if (event.type == sf::Event::KeyPressed) {
+                energyIsStale = true;
                 if (event.key.code == sf::Keyboard::E) {
-                    
+
                     GravityObject newObject;
                     newObject.position.x = mousePosition.x;
                     newObject.position.y = mousePosition.y;
 
                     gravityObjects.push_back(newObject);
                 }
+                if (event.key.code == sf::Keyboard::G) {
+                    spawnGalaxy(gravityObjects, sf::Vector2f(mousePosition.x, mousePosition.y), galaxySize, 300.0f, G, gen);
+                    std::cout << gravityObjects.size() << " bodies\n";
+                }
+                if (event.key.code == sf::Keyboard::B) {
+                    stepper.useBarnesHut = !stepper.useBarnesHut;
+                    if (stepper.useBarnesHut) {
+                        std::cout << "Barnes-Hut, theta " << stepper.theta << "\n";
+                    }
+                    else {
+                        std::cout << "exact pairwise sum\n";
+                    }
+                }
+                if (event.key.code == sf::Keyboard::LBracket) {
+                    stepper.theta = std::max(0.0f, stepper.theta - 0.1f);
+                    std::cout << "theta " << stepper.theta << "\n";
+                }
+                if (event.key.code == sf::Keyboard::RBracket) {
+                    stepper.theta += 0.1f;
+                    std::cout << "theta " << stepper.theta << "\n";
+                }
+                if (event.key.code == sf::Keyboard::I) {
+                    stepper.integrator = (Integrator)((stepper.integrator + 1) % IntegratorCount);
+                    std::cout << integratorName(stepper.integrator) << "\n";
+                }
+                if (event.key.code == sf::Keyboard::Equal) {
+                    stepper.subSteps++;
+                    std::cout << stepper.subSteps << " sub-steps per time unit\n";
+                }
+                if (event.key.code == sf::Keyboard::Hyphen && stepper.subSteps > 1) {
+                    stepper.subSteps--;
+                    std::cout << stepper.subSteps << " sub-steps per time unit\n";
+                }
             }
             if (event.type == sf::Event::MouseButtonPressed) {
+                energyIsStale = true;
                 if (event.mouseButton.button == sf::Mouse::Left) {
                     sf::Vector2f clickPosition(event.mouseButton.x, event.mouseButton.y);
                     for (GravityObject &obj : gravityObjects) {
                         if (magnitude(clickPosition - obj.position) < obj.radius) {
                             obj.isGrabbed = true;
-                        } 
+                        }
                     }
                 }
             }
             if (event.type == sf::Event::MouseButtonReleased) {
+                energyIsStale = true;
                 if (event.mouseButton.button == sf::Mouse::Left) {
                     for (GravityObject &obj : gravityObjects) {
                         obj.isGrabbed = false;
@@ -90,25 +494,25 @@ int main() {
         }
 
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::A)) {
-            
+
             for (GravityObject &obj : gravityObjects) {
                 obj.position.x += scrollSpeed;
             }
         }
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::D)) {
-            
+
             for (GravityObject &obj : gravityObjects) {
                 obj.position.x -= scrollSpeed;
             }
         }
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::W)) {
-            
+
             for (GravityObject &obj : gravityObjects) {
                 obj.position.y += scrollSpeed;
             }
         }
         else if (sf::Keyboard::isKeyPressed(sf::Keyboard::S)) {
-            
+
             for (GravityObject &obj : gravityObjects) {
                 obj.position.y -= scrollSpeed;
             }
@@ -116,31 +520,35 @@ int main() {
 
 
         window.clear(sf::Color(10, 10, 10));
-        // Update and draw all gravity objects
+
+        // The mouse sets the velocity of grabbed bodies, the stepper does the rest
         for (GravityObject &gravityObject : gravityObjects) {
             if (gravityObject.isGrabbed) {
                 gravityObject.velocity.x = (mousePosition.x - gravityObject.position.x) * 0.1f;
                 gravityObject.velocity.y = (mousePosition.y - gravityObject.position.y) * 0.1f;
+                energyIsStale = true;
             }
-            else {
-                for (GravityObject &otherObject : gravityObjects) {
-                    if (&gravityObject == &otherObject) {
-                        continue;
-                    }
-                    sf::Vector2f acceleration = gravitationalAcceleration(gravityObject, otherObject, 10000);
-                    gravityObject.velocity.x += acceleration.x;
-                    gravityObject.velocity.y += acceleration.y;
-                }
-            }
-            gravityObject.position.x += gravityObject.velocity.x;
-            gravityObject.position.y += gravityObject.velocity.y;
+        }
+
+        stepper.advanceFrame(gravityObjects, frameClock.restart().asSeconds());
+
+        if (energyIsStale) {
+            referenceEnergy = stepper.energy(gravityObjects);
+            energyIsStale = false;
+            framesSinceReport = 0;
+        }
+        else if (++framesSinceReport == 60 && !gravityObjects.empty()) {
+            double drift = (stepper.energy(gravityObjects) - referenceEnergy) / std::abs(referenceEnergy);
+            std::cout << "energy drift " << drift << " (" << integratorName(stepper.integrator)
+                      << ", " << stepper.subSteps << " sub-steps)\n";
+            framesSinceReport = 0;
+        }
 
-            sf::CircleShape circleShape(gravityObject.radius);
-            circleShape.setFillColor(sf::Color(0, 120, 255));
-            circleShape.setOrigin(gravityObject.radius, gravityObject.radius);
-            circleShape.setPosition(gravityObject.position);
-            window.draw(circleShape);
+        batch.resize(gravityObjects.size());
+        for (std::size_t i = 0; i < gravityObjects.size(); ++i) {
+            batch.set(i, gravityObjects[i].position, gravityObjects[i].radius, sf::Color(0, 120, 255));
         }
+        window.draw(batch);
         window.display();
     }
 
@@ -6,6 +6,17 @@
 #include <omp.h>
 #include <iomanip>
 #include <sstream>
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <cstdio>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 struct ComplexNumber {
     double x;
@@ -24,11 +35,867 @@ inline ComplexNumber complexPow(const ComplexNumber &z, double power) {
 
 }
 
+// Iteration at which z escapes, or -1 if it doesn't within maxIterations.
+// Integer exponents are plain complex multiplies, anything else goes through complexPow.
+inline int escapeTime(double cx, double cy, int maxIterations, double exponent) {
+    int integerExponent = (int)exponent;
+    bool isInteger = integerExponent == exponent && integerExponent >= 2;
 
-int main() {
-    sf::Vector2i windowSize(1500, 1500);
+    double zx = 0.0;
+    double zy = 0.0;
+    for (int i = 0; i < maxIterations; ++i) {
+        if (isInteger && integerExponent == 2) {
+            double x = zx * zx - zy * zy + cx;
+            zy = 2.0 * zx * zy + cy;
+            zx = x;
+        } else if (isInteger) {
+            double px = zx;
+            double py = zy;
+            for (int k = 1; k < integerExponent; ++k) {
+                double x = px * zx - py * zy;
+                py = px * zy + py * zx;
+                px = x;
+            }
+            zx = px + cx;
+            zy = py + cy;
+        } else {
+            ComplexNumber power = complexPow(ComplexNumber(zx, zy), exponent);
+            zx = power.x + cx;
+            zy = power.y + cy;
+        }
+
+        if (zx * zx + zy * zy > 4.0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if defined(__AVX2__)
+// escapeTime for 4 pixels in a row at once, integer exponents only. Lanes that escaped keep
+// their iteration count, and the loop stops as soon as all of them did.
+inline void escapeTime4(__m256d cx, __m256d cy, int maxIterations, int exponent, int result[4]) {
+    __m256d zx = _mm256_setzero_pd();
+    __m256d zy = _mm256_setzero_pd();
+    __m256d four = _mm256_set1_pd(4.0);
+    __m256d two = _mm256_set1_pd(2.0);
+    __m256i escapedAt = _mm256_set1_epi64x(-1);
+    __m256d active = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+    for (int i = 0; i < maxIterations; ++i) {
+        if (exponent == 2) {
+            __m256d x = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(zx, zx), _mm256_mul_pd(zy, zy)), cx);
+            zy = _mm256_add_pd(_mm256_mul_pd(two, _mm256_mul_pd(zx, zy)), cy);
+            zx = x;
+        } else {
+            __m256d px = zx;
+            __m256d py = zy;
+            for (int k = 1; k < exponent; ++k) {
+                __m256d x = _mm256_sub_pd(_mm256_mul_pd(px, zx), _mm256_mul_pd(py, zy));
+                py = _mm256_add_pd(_mm256_mul_pd(px, zy), _mm256_mul_pd(py, zx));
+                px = x;
+            }
+            zx = _mm256_add_pd(px, cx);
+            zy = _mm256_add_pd(py, cy);
+        }
+
+        __m256d magnitude = _mm256_add_pd(_mm256_mul_pd(zx, zx), _mm256_mul_pd(zy, zy));
+        __m256d escaped = _mm256_and_pd(_mm256_cmp_pd(magnitude, four, _CMP_GT_OQ), active);
+        if (_mm256_movemask_pd(escaped)) {
+            escapedAt = _mm256_castpd_si256(_mm256_blendv_pd(_mm256_castsi256_pd(escapedAt),
+                                                             _mm256_castsi256_pd(_mm256_set1_epi64x(i)), escaped));
+            active = _mm256_andnot_pd(escaped, active);
+            if (!_mm256_movemask_pd(active)) {
+                break;
+            }
+        }
+    }
+
+    alignas(32) long long lanes[4];
+    _mm256_store_si256((__m256i*)lanes, escapedAt);
+    for (int k = 0; k < 4; ++k) {
+        result[k] = (int)lanes[k];
+    }
+}
+#endif
+
+// Red to magenta for the first 1% of the iterations, then on to blue
+inline sf::Color escapeColor(int i, int maxIterations) {
+    float t = static_cast<float>(i) / maxIterations;
+    float threshold = 0.01f;
+
+    if (t <= threshold) {
+        float u = t / threshold;
+        return sf::Color(
+            255,
+            0,
+            static_cast<sf::Uint8>(255 * u)
+        );
+    }
+    float u = (t - threshold) / (1-threshold);
+    return sf::Color(
+        static_cast<sf::Uint8>(255 * (1.0f - u)),
+        0,
+        255
+    );
+}
+
+inline void writeEscape(std::vector<sf::Uint8>& pixels, int index, int escape, int maxIterations) {
+    sf::Color color = escape < 0 ? sf::Color::Black : escapeColor(escape, maxIterations);
+    sf::Uint8* pixel = &pixels[index * 4];
+    pixel[0] = color.r;
+    pixel[1] = color.g;
+    pixel[2] = color.b;
+    pixel[3] = 255;
+}
+
+// Renders the columns x0..x1 and rows y0..y1 of a width x height image of [xMin, xMax] x [yMin, yMax]
+void renderRegion(std::vector<sf::Uint8>& pixels, int width, int height, int x0, int y0, int x1, int y1,
+                  double xMin, double xMax, double yMin, double yMax, int maxIterations, double exponent) {
+#if defined(__AVX2__)
+    int integerExponent = (int)exponent;
+    bool vectorize = integerExponent == exponent && integerExponent >= 2;
+#endif
+
+    for (int y = y0; y < y1; ++y) {
+        double cy = yMin + (yMax - yMin) * y / height;
+        int x = x0;
+#if defined(__AVX2__)
+        if (vectorize) {
+            for (; x + 4 <= x1; x += 4) {
+                __m256d cx = _mm256_setr_pd(xMin + (xMax - xMin) * x / width, xMin + (xMax - xMin) * (x + 1) / width,
+                                            xMin + (xMax - xMin) * (x + 2) / width, xMin + (xMax - xMin) * (x + 3) / width);
+                int escapes[4];
+                escapeTime4(cx, _mm256_set1_pd(cy), maxIterations, integerExponent, escapes);
+                for (int k = 0; k < 4; ++k) {
+                    writeEscape(pixels, y * width + x + k, escapes[k], maxIterations);
+                }
+            }
+        }
+#endif
+        for (; x < x1; ++x) {
+            writeEscape(pixels, y * width + x, escapeTime(xMin + (xMax - xMin) * x / width, cy, maxIterations, exponent), maxIterations);
+        }
+    }
+}
+
+// Renders into an RGBA buffer, in tiles handed out to the threads as they finish
+void renderMandelbrot(std::vector<sf::Uint8>& pixels, int width, int height, double xMin, double xMax, double yMin, double yMax,
+                      int maxIterations, double exponent) {
+    const int tileSize = 32;
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+
+    pixels.resize(width * height * 4);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tilesX * tilesY; ++tile) {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        renderRegion(pixels, width, height, x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height),
+                     xMin, xMax, yMin, yMax, maxIterations, exponent);
+    }
+}
+
+
+// Fixed point number in sign and magnitude, with 32 bit limbs. limbs.back() is the integer part and
+// the rest is the fraction, so the precision is 32 * (limbs - 1) bits. Only used for the reference orbit.
+class BigFixed {
+    public:
+        bool negative = false;
+        std::vector<std::uint32_t> limbs;
+
+    BigFixed(int limbCount = 4, double value = 0.0) {
+        limbs.assign(limbCount, 0);
+        negative = value < 0.0;
+        value = std::fabs(value);
+        // Takes the double apart 32 bits at a time, starting at the integer part
+        for (int i = limbCount - 1; i >= 0 && value > 0.0; --i) {
+            double limb = std::floor(value);
+            limbs[i] = (std::uint32_t)limb;
+            value = (value - limb) * 4294967296.0;
+        }
+    }
+
+    // Decimal text like "-0.04524074110000000000000000000001"
+    static BigFixed parse(const std::string& text, int limbCount) {
+        BigFixed result(limbCount);
+        std::size_t start = (text[0] == '-' || text[0] == '+') ? 1 : 0;
+        std::size_t point = text.find('.');
+        if (point == std::string::npos) {
+            point = text.size();
+        }
+
+        // Fraction digits from the last one: fraction = (digit + fraction) / 10
+        for (std::size_t i = text.size(); i-- > point + 1;) {
+            result.limbs.back() += text[i] - '0';
+            result.divide(10);
+        }
+        std::uint32_t integer = 0;
+        for (std::size_t i = start; i < point; ++i) {
+            integer = integer * 10 + (text[i] - '0');
+        }
+        result.limbs.back() += integer;
+        result.negative = text[0] == '-';
+        return result;
+    }
+
+    double toDouble() const {
+        double value = 0.0;
+        double scale = 1.0;
+        for (int i = limbs.size() - 1; i >= 0; --i) {
+            value += limbs[i] * scale;
+            scale /= 4294967296.0;
+        }
+        return negative ? -value : value;
+    }
+
+    BigFixed operator+(const BigFixed& other) const {
+        if (negative == other.negative) {
+            BigFixed result = *this;
+            result.addMagnitude(other);
+            return result;
+        }
+        if (compareMagnitude(other) >= 0) {
+            BigFixed result = *this;
+            result.subtractMagnitude(other);
+            return result;
+        }
+        BigFixed result = other;
+        result.subtractMagnitude(*this);
+        return result;
+    }
+
+    BigFixed operator-(const BigFixed& other) const {
+        BigFixed negated = other;
+        negated.negative = !negated.negative;
+        return *this + negated;
+    }
+
+    BigFixed operator*(const BigFixed& other) const {
+        int n = limbs.size();
+        std::vector<std::uint64_t> product(2 * n + 1, 0);
+        for (int i = 0; i < n; ++i) {
+            std::uint64_t carry = 0;
+            for (int j = 0; j < n; ++j) {
+                std::uint64_t sum = product[i + j] + (std::uint64_t)limbs[i] * other.limbs[j] + carry;
+                product[i + j] = sum & 0xFFFFFFFFu;
+                carry = sum >> 32;
+            }
+            product[i + n] += carry;
+        }
+
+        // Drop the extra fraction limbs (truncating), keep the integer limb
+        BigFixed result(n);
+        for (int i = 0; i < n; ++i) {
+            result.limbs[i] = (std::uint32_t)product[i + n - 1];
+        }
+        result.negative = negative != other.negative;
+        return result;
+    }
+
+    private:
+    int compareMagnitude(const BigFixed& other) const {
+        for (int i = limbs.size() - 1; i >= 0; --i) {
+            if (limbs[i] != other.limbs[i]) {
+                return limbs[i] < other.limbs[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+
+    void addMagnitude(const BigFixed& other) {
+        std::uint64_t carry = 0;
+        for (std::size_t i = 0; i < limbs.size(); ++i) {
+            std::uint64_t sum = (std::uint64_t)limbs[i] + other.limbs[i] + carry;
+            limbs[i] = (std::uint32_t)sum;
+            carry = sum >> 32;
+        }
+    }
+
+    // Needs |this| >= |other|
+    void subtractMagnitude(const BigFixed& other) {
+        std::int64_t borrow = 0;
+        for (std::size_t i = 0; i < limbs.size(); ++i) {
+            std::int64_t difference = (std::int64_t)limbs[i] - other.limbs[i] - borrow;
+            borrow = difference < 0;
+            limbs[i] = (std::uint32_t)(difference + (borrow << 32));
+        }
+    }
+
+    void divide(std::uint32_t divisor) {
+        std::uint64_t remainder = 0;
+        for (int i = limbs.size() - 1; i >= 0; --i) {
+            std::uint64_t value = (remainder << 32) | limbs[i];
+            limbs[i] = (std::uint32_t)(value / divisor);
+            remainder = value % divisor;
+        }
+    }
+};
+
+// z^2 + c orbit of the center point in high precision, rounded to doubles since those are only
+// ever added to the small pixel offsets. Stops at the first point that escapes.
+std::vector<ComplexNumber> referenceOrbit(const BigFixed& cx, const BigFixed& cy, int maxIterations) {
+    std::vector<ComplexNumber> orbit;
+    BigFixed zx(cx.limbs.size());
+    BigFixed zy(cy.limbs.size());
+    orbit.push_back(ComplexNumber(0.0, 0.0));
 
+    for (int i = 0; i < maxIterations; ++i) {
+        BigFixed x = zx * zx - zy * zy + cx;
+        BigFixed xy = zx * zy;
+        zy = xy + xy + cy;
+        zx = x;
+
+        ComplexNumber z(zx.toDouble(), zy.toDouble());
+        orbit.push_back(z);
+        if (z.x * z.x + z.y * z.y > 4.0) {
+            break;
+        }
+    }
+    return orbit;
+}
+
+// Perturbation: every pixel is iterated as the difference d to the reference orbit Z,
+// d' = 2 Z d + d^2 + dc, which stays accurate in doubles however deep the zoom is.
+// When the reference escapes or z gets closer to 0 than d is (where the difference would lose its
+// precision), the pixel continues from the start of the same reference with d = z (Zhuoran's rebasing).
+// The first iterations are skipped with the series d = A dc + B dc^2 + C dc^3, for as long as the
+// cubic term stays negligible across the whole screen.
+void renderPerturbation(std::vector<sf::Uint8>& pixels, int width, int height, const BigFixed& centerX, const BigFixed& centerY,
+                        double screenRadius, int maxIterations) {
+    std::vector<ComplexNumber> orbit = referenceOrbit(centerX, centerY, maxIterations);
+    int orbitEnd = orbit.size() - 1;
+
+    // Series coefficients, A(n+1) = 2 Z A + 1, B(n+1) = 2 Z B + A^2, C(n+1) = 2 Z C + 2 A B
+    double ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+    double radius = screenRadius * std::sqrt(2.0);
+    int skipped = 0;
+    while (skipped < orbitEnd - 1) {
+        const ComplexNumber& z = orbit[skipped];
+        double nax = 2 * (z.x * ax - z.y * ay) + 1;
+        double nay = 2 * (z.x * ay + z.y * ax);
+        double nbx = 2 * (z.x * bx - z.y * by) + (ax * ax - ay * ay);
+        double nby = 2 * (z.x * by + z.y * bx) + 2 * ax * ay;
+        double ncx = 2 * (z.x * cx - z.y * cy) + 2 * (ax * bx - ay * by);
+        double ncy = 2 * (z.x * cy + z.y * cx) + 2 * (ax * by + ay * bx);
+
+        double firstOrder = std::hypot(nax, nay) * radius;
+        double thirdOrder = std::hypot(ncx, ncy) * radius * radius * radius;
+        if (!(thirdOrder < 1e-9 * firstOrder) || firstOrder > 1e-3) {
+            break;
+        }
+        ax = nax; ay = nay; bx = nbx; by = nby; cx = ncx; cy = ncy;
+        skipped++;
+    }
+    std::cout << "reference orbit " << orbitEnd << " iterations, skipped " << skipped << "\n";
+
+    const int tileSize = 32;
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    pixels.resize(width * height * 4);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tilesX * tilesY; ++tile) {
+        int x0 = (tile % tilesX) * tileSize;
+        int y0 = (tile / tilesX) * tileSize;
+        for (int y = y0; y < std::min(y0 + tileSize, height); ++y) {
+            for (int x = x0; x < std::min(x0 + tileSize, width); ++x) {
+                double dcx = screenRadius * (2.0 * x / width - 1.0);
+                double dcy = screenRadius * (2.0 * y / height - 1.0);
+
+                // d = A dc + B dc^2 + C dc^3
+                double dc2x = dcx * dcx - dcy * dcy;
+                double dc2y = 2 * dcx * dcy;
+                double dc3x = dc2x * dcx - dc2y * dcy;
+                double dc3y = dc2x * dcy + dc2y * dcx;
+                double dx = ax * dcx - ay * dcy + bx * dc2x - by * dc2y + cx * dc3x - cy * dc3y;
+                double dy = ax * dcy + ay * dcx + bx * dc2y + by * dc2x + cx * dc3y + cy * dc3x;
+
+                int escaped = -1;
+                int m = skipped;
+                for (int i = skipped; i < maxIterations; ++i) {
+                    const ComplexNumber& z = orbit[m];
+                    double ndx = 2 * (z.x * dx - z.y * dy) + dx * dx - dy * dy + dcx;
+                    dy = 2 * (z.x * dy + z.y * dx) + 2 * dx * dy + dcy;
+                    dx = ndx;
+                    m++;
+
+                    double zx = orbit[m].x + dx;
+                    double zy = orbit[m].y + dy;
+                    double magnitude = zx * zx + zy * zy;
+                    if (magnitude > 4.0) {
+                        escaped = i;
+                        break;
+                    }
+                    if (magnitude < dx * dx + dy * dy || m == orbitEnd) {
+                        dx = zx;
+                        dy = zy;
+                        m = 0;
+                    }
+                }
+
+                writeEscape(pixels, y * width + x, escaped, maxIterations);
+            }
+        }
+    }
+}
+
+// Interactive explorer. The plane is cut into 256x256 pixel tiles per zoom level (level 0 is one tile
+// for [0, 4) x [0, 4), every level halves that). A pool of worker threads renders the tiles the view
+// needs, first at a quarter of the resolution and then in full, and the finished tiles are kept as
+// textures, so panning and zooming back reuse everything already computed.
+struct TileKey {
+    int level;
+    long long x;
+    long long y;
+    int maxIterations;
+
+    bool operator==(const TileKey& other) const {
+        return level == other.level && x == other.x && y == other.y && maxIterations == other.maxIterations;
+    }
+};
+
+struct TileKeyHash {
+    std::size_t operator()(const TileKey& key) const {
+        std::size_t hash = key.level;
+        hash = hash * 1000003 + std::hash<long long>()(key.x);
+        hash = hash * 1000003 + std::hash<long long>()(key.y);
+        return hash * 1000003 + key.maxIterations;
+    }
+};
+
+class TileCache {
+    public:
+        static constexpr int tileSize = 256;
+        static constexpr int coarseSize = tileSize / 4;
+        static constexpr int maxLevel = 40;
+        static constexpr std::size_t maxTiles = 512;
+
+        double exponent;
+
+    TileCache(double exponent_) {
+        exponent = exponent_;
+        // hardware_concurrency is 0 when it can't tell
+        int workerCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+        for (int i = 0; i < workerCount; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~TileCache() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    static double tileWorldSize(int level) {
+        return 4.0 / std::pow(2.0, level);
+    }
+
+    // Replaces the queue with the jobs for these tiles, in order: all coarse passes, then the full ones
+    void request(const std::vector<TileKey>& keys) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.clear();
+        for (int quality = 1; quality <= 2; ++quality) {
+            for (const TileKey& key : keys) {
+                auto found = tiles.find(key);
+                int cached = found == tiles.end() ? 0 : found->second.quality;
+                if (cached < quality && !isRunning(key, quality)) {
+                    queue.push_back({key, quality});
+                }
+            }
+        }
+        wake.notify_all();
+    }
+
+    // Uploads finished tiles, on the main thread since that's where the OpenGL context lives. They count
+    // as used in this frame, so evict doesn't throw them out before they're ever drawn
+    void upload(int frame) {
+        std::vector<Result> finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.swap(results);
+        }
+
+        for (Result& result : finished) {
+            CachedTile& tile = tiles[result.job.key];
+            if (tile.quality >= result.job.quality) {
+                continue;
+            }
+            if (tile.quality == 0) {
+                tile.texture.create(tileSize, tileSize);
+            }
+            tile.texture.update(result.pixels.data());
+            tile.quality = result.job.quality;
+            tile.lastUsed = frame;
+        }
+
+        if (tiles.size() > maxTiles) {
+            evict();
+        }
+    }
+
+    // The tile if it has been rendered at all
+    const sf::Texture* find(const TileKey& key, int frame) {
+        auto found = tiles.find(key);
+        if (found == tiles.end() || found->second.quality == 0) {
+            return nullptr;
+        }
+        found->second.lastUsed = frame;
+        return &found->second.texture;
+    }
+
+    private:
+        struct Job {
+            TileKey key;
+            // 1 is the coarse pass, 2 the full one
+            int quality;
+        };
+
+        struct Result {
+            Job job;
+            std::vector<sf::Uint8> pixels;
+        };
+
+        struct CachedTile {
+            sf::Texture texture;
+            int quality = 0;
+            int lastUsed = 0;
+        };
+
+        std::unordered_map<TileKey, CachedTile, TileKeyHash> tiles;
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<Job> queue;
+        std::vector<Job> running;
+        std::vector<Result> results;
+        bool stopping = false;
+
+    // Whether a worker is on the job or has finished it and it's waiting for upload
+    bool isRunning(const TileKey& key, int quality) const {
+        for (const Job& job : running) {
+            if (job.key == key && job.quality >= quality) {
+                return true;
+            }
+        }
+        for (const Result& result : results) {
+            if (result.job.key == key && result.job.quality >= quality) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work() {
+        std::vector<sf::Uint8> coarse(coarseSize * coarseSize * 4);
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = queue.front();
+                queue.pop_front();
+                running.push_back(job);
+            }
+
+            double size = tileWorldSize(job.key.level);
+            double xMin = job.key.x * size;
+            double yMin = job.key.y * size;
+            Result result{job, std::vector<sf::Uint8>(tileSize * tileSize * 4)};
+            if (job.quality == 1) {
+                // Every coarse pixel becomes a 4x4 block
+                renderRegion(coarse, coarseSize, coarseSize, 0, 0, coarseSize, coarseSize, xMin, xMin + size, yMin, yMin + size,
+                             job.key.maxIterations, exponent);
+                for (int y = 0; y < tileSize; ++y) {
+                    for (int x = 0; x < tileSize; ++x) {
+                        std::copy_n(&coarse[((y / 4) * coarseSize + x / 4) * 4], 4, &result.pixels[(y * tileSize + x) * 4]);
+                    }
+                }
+            } else {
+                renderRegion(result.pixels, tileSize, tileSize, 0, 0, tileSize, tileSize, xMin, xMin + size, yMin, yMin + size,
+                             job.key.maxIterations, exponent);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::size_t i = 0; i < running.size(); ++i) {
+                if (running[i].key == job.key && running[i].quality == job.quality) {
+                    running.erase(running.begin() + i);
+                    break;
+                }
+            }
+            results.push_back(std::move(result));
+        }
+    }
+
+    // Drops the tiles that haven't been drawn for the longest time
+    void evict() {
+        std::vector<std::pair<int, TileKey>> byAge;
+        for (const auto& entry : tiles) {
+            byAge.push_back({entry.second.lastUsed, entry.first});
+        }
+        std::sort(byAge.begin(), byAge.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (std::size_t i = 0; i < byAge.size() - maxTiles * 3 / 4; ++i) {
+            tiles.erase(byAge[i].second);
+        }
+    }
+};
+
+// Drag to pan, scroll to zoom at the cursor, up and down double or halve the iterations
+void runExplorer(sf::Vector2i windowSize, int maxIterations, double exponent) {
     sf::RenderWindow window(sf::VideoMode(windowSize.x, windowSize.y), "Mandelbrot set");
+    window.setFramerateLimit(60);
+
+    TileCache cache(exponent);
+    sf::Vector2<double> center(-0.5, 0.0);
+    double unitsPerPixel = 3.0 / windowSize.y;
+    bool dragging = false;
+    sf::Vector2i lastMouse;
+    int frame = 0;
+
+    while (window.isOpen()) {
+        sf::Event event;
+        while (window.pollEvent(event)) {
+            if (event.type == sf::Event::Closed) {
+                window.close();
+            }
+            if (event.type == sf::Event::MouseButtonPressed && event.mouseButton.button == sf::Mouse::Left) {
+                dragging = true;
+                lastMouse = sf::Vector2i(event.mouseButton.x, event.mouseButton.y);
+            }
+            if (event.type == sf::Event::MouseButtonReleased && event.mouseButton.button == sf::Mouse::Left) {
+                dragging = false;
+            }
+            if (event.type == sf::Event::MouseMoved && dragging) {
+                center.x -= (event.mouseMove.x - lastMouse.x) * unitsPerPixel;
+                center.y -= (event.mouseMove.y - lastMouse.y) * unitsPerPixel;
+                lastMouse = sf::Vector2i(event.mouseMove.x, event.mouseMove.y);
+            }
+            if (event.type == sf::Event::MouseWheelScrolled) {
+                // Keep the point under the cursor in place
+                double factor = std::pow(0.8, event.mouseWheelScroll.delta);
+                double mouseX = center.x + (event.mouseWheelScroll.x - windowSize.x / 2.0) * unitsPerPixel;
+                double mouseY = center.y + (event.mouseWheelScroll.y - windowSize.y / 2.0) * unitsPerPixel;
+                unitsPerPixel = std::max(unitsPerPixel * factor, TileCache::tileWorldSize(TileCache::maxLevel) / TileCache::tileSize);
+                center.x = mouseX - (event.mouseWheelScroll.x - windowSize.x / 2.0) * unitsPerPixel;
+                center.y = mouseY - (event.mouseWheelScroll.y - windowSize.y / 2.0) * unitsPerPixel;
+            }
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Up) {
+                maxIterations *= 2;
+                std::cout << "max iterations " << maxIterations << "\n";
+            }
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Down) {
+                maxIterations = std::max(16, maxIterations / 2);
+                std::cout << "max iterations " << maxIterations << "\n";
+            }
+        }
+
+        // The level where tile pixels are at least as small as screen pixels
+        int level = std::clamp((int)std::ceil(std::log2(4.0 / (TileCache::tileSize * unitsPerPixel))), 0, TileCache::maxLevel);
+        double left = center.x - windowSize.x / 2.0 * unitsPerPixel;
+        double top = center.y - windowSize.y / 2.0 * unitsPerPixel;
+        double right = center.x + windowSize.x / 2.0 * unitsPerPixel;
+        double bottom = center.y + windowSize.y / 2.0 * unitsPerPixel;
+
+        auto visibleTiles = [&](int tileLevel) {
+            double size = TileCache::tileWorldSize(tileLevel);
+            std::vector<TileKey> keys;
+            for (long long ty = (long long)std::floor(top / size); ty * size < bottom; ++ty) {
+                for (long long tx = (long long)std::floor(left / size); tx * size < right; ++tx) {
+                    keys.push_back({tileLevel, tx, ty, maxIterations});
+                }
+            }
+            return keys;
+        };
+
+        // Tiles closest to the middle of the screen first
+        std::vector<TileKey> wanted = visibleTiles(level);
+        double size = TileCache::tileWorldSize(level);
+        std::sort(wanted.begin(), wanted.end(), [&](const TileKey& a, const TileKey& b) {
+            return std::hypot((a.x + 0.5) * size - center.x, (a.y + 0.5) * size - center.y) <
+                   std::hypot((b.x + 0.5) * size - center.x, (b.y + 0.5) * size - center.y);
+        });
+        cache.upload(frame);
+        cache.request(wanted);
+
+        window.clear();
+        // Coarser levels first, they fill in where the current level isn't done yet
+        for (int tileLevel = std::max(0, level - 4); tileLevel <= level; ++tileLevel) {
+            double tileSize = TileCache::tileWorldSize(tileLevel);
+            for (const TileKey& key : visibleTiles(tileLevel)) {
+                const sf::Texture* texture = cache.find(key, frame);
+                if (texture == nullptr) {
+                    continue;
+                }
+                sf::Sprite sprite(*texture);
+                sprite.setPosition((key.x * tileSize - left) / unitsPerPixel, (key.y * tileSize - top) / unitsPerPixel);
+                float scale = tileSize / unitsPerPixel / TileCache::tileSize;
+                sprite.setScale(scale, scale);
+                window.draw(sprite);
+            }
+        }
+        window.display();
+        frame++;
+    }
+}
+
+// Where the animation should be at a given frame, exponent and zoom are interpolated in between
+struct Keyframe {
+    int frame;
+    double exponent;
+    double zoom;
+};
+
+// Parses "<frame>:<exponent>:<zoom>"
+bool parseKeyframe(const std::string& text, Keyframe& keyframe) {
+    std::istringstream stream(text);
+    char separator1, separator2;
+    return (stream >> keyframe.frame >> separator1 >> keyframe.exponent >> separator2 >> keyframe.zoom) &&
+           separator1 == ':' && separator2 == ':' && keyframe.zoom > 0;
+}
+
+Keyframe interpolate(const std::vector<Keyframe>& keyframes, int frame) {
+    if (frame <= keyframes.front().frame) {
+        return keyframes.front();
+    }
+    for (std::size_t i = 1; i < keyframes.size(); ++i) {
+        const Keyframe& a = keyframes[i - 1];
+        const Keyframe& b = keyframes[i];
+        if (frame <= b.frame) {
+            double t = (double)(frame - a.frame) / (b.frame - a.frame);
+            // Zooming geometrically looks like a constant speed
+            return {frame, a.exponent + (b.exponent - a.exponent) * t, a.zoom * std::pow(b.zoom / a.zoom, t)};
+        }
+    }
+    return keyframes.back();
+}
+
+// Writes finished frames on its own thread, so the next frame can be rendered meanwhile.
+// The target is "-" for stdout, "|command" to pipe into a command (e.g. ffmpeg), a path ending in '/'
+// for one PNG per frame in that directory, or otherwise a file. Everything but PNG gets raw RGBA frames.
+class FrameWriter {
+    public:
+    FrameWriter(const std::string& target, int width_, int height_) {
+        width = width_;
+        height = height_;
+        if (target.empty()) {
+            // Nothing to open, isOpen reports it
+        } else if (target.back() == '/') {
+            directory = target;
+        } else if (target == "-") {
+            output = stdout;
+        } else if (target[0] == '|') {
+            output = popen(target.c_str() + 1, "w");
+            piped = true;
+        } else {
+            output = std::fopen(target.c_str(), "wb");
+        }
+        thread = std::thread([this] { work(); });
+    }
+
+    ~FrameWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        changed.notify_all();
+        thread.join();
+
+        if (output == nullptr) {
+            return;
+        }
+        if (piped) {
+            pclose(output);
+        } else if (output != stdout) {
+            std::fclose(output);
+        }
+    }
+
+    bool isOpen() const {
+        return !directory.empty() || output != nullptr;
+    }
+
+    // Queues the frame and hands back a free buffer in its place, waiting only while the frame before
+    // is still queued. The buffers keep cycling, so after the first few frames nothing is allocated.
+    void submit(std::vector<sf::Uint8>& pixels) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return !hasPending; });
+        pending.swap(pixels);
+        hasPending = true;
+        changed.notify_all();
+    }
+
+    private:
+        int width;
+        int height;
+        std::string directory;
+        FILE* output = nullptr;
+        bool piped = false;
+        int frameCount = 1;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<sf::Uint8> pending;
+        std::vector<sf::Uint8> writing;
+        bool hasPending = false;
+        bool finished = false;
+
+    void work() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return hasPending || finished; });
+                if (!hasPending) {
+                    return;
+                }
+                writing.swap(pending);
+                hasPending = false;
+            }
+            changed.notify_all();
+
+            if (!directory.empty()) {
+                std::ostringstream filenameStream;
+                filenameStream << directory << "frame_" << std::setw(4) << std::setfill('0') << frameCount << ".png";
+
+                sf::Image image;
+                image.create(width, height, writing.data());
+                image.saveToFile(filenameStream.str());
+            } else {
+                std::fwrite(writing.data(), 1, writing.size(), output);
+            }
+            frameCount++;
+        }
+    }
+};
+
+// Renders every frame from the first keyframe to the last into the writer
+void renderAnimation(const std::vector<Keyframe>& keyframes, FrameWriter& writer, sf::Vector2i windowSize,
+                     double xCenter, double yCenter, int maxIterations) {
+    std::vector<sf::Uint8> pixels;
+    for (int frame = keyframes.front().frame; frame <= keyframes.back().frame; ++frame) {
+        Keyframe state = interpolate(keyframes, frame);
+        double screenRadius = 1.5/state.zoom;
+        renderMandelbrot(pixels, windowSize.x, windowSize.y, xCenter - screenRadius, xCenter + screenRadius,
+                         -yCenter - screenRadius, -yCenter + screenRadius, maxIterations, state.exponent);
+        writer.submit(pixels);
+        // Not stdout, that might be the video
+        std::cerr << "\rFrame " << frame << "/" << keyframes.back().frame << std::flush;
+    }
+    std::cerr << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    sf::Vector2i windowSize(1500, 1500);
 
     int maxIterations = 1500;
     // std::cout << "Max iterations: ";
@@ -51,55 +918,65 @@ int main() {
     double yMin = -yCenter - screenRadius;
     double yMax = -yCenter + screenRadius;
 
-    int frameCount = 1;
+    std::vector<sf::Uint8> pixels;
 
+    if (argc >= 2 && std::string(argv[1]) == "--explore") {
+        runExplorer(windowSize, maxIterations, exponent);
+        return 0;
+    }
 
-    sf::Image image;
-    image.create(windowSize.x, windowSize.y, sf::Color::Black);
-    #pragma omp parallel for collapse(2)
-    for (int x = 0; x < windowSize.x; x++) {
-        for (int y = 0; y < windowSize.y; y++) {
-            ComplexNumber c(0.0, 0.0);
-            ComplexNumber z(0.0, 0.0);
-
-            c.x = xMin + (xMax - xMin) * x / windowSize.x;
-            c.y = yMin + (yMax - yMin) * y / windowSize.y;
-
-
-            for (int i = 0; i < maxIterations; ++i) {
-                ComplexNumber power = complexPow(z, exponent);
-
-                z.x = power.x + c.x;
-                z.y = power.y + c.y;
-
-                if (z.x * z.x + z.y * z.y > 4.0) {
-                    float t = static_cast<float>(i) / maxIterations;
-                    float threshold = 0.01f;
-
-                    sf::Color color;
-                    if (t <= threshold) {
-                        float u = t / threshold;
-                        color = sf::Color(
-                            255,
-                            0,
-                            static_cast<sf::Uint8>(255 * u)
-                        );
-                    } else {
-                        float u = (t - threshold) / (1-threshold);
-                        color = sf::Color(
-                            static_cast<sf::Uint8>(255 * (1.0f - u)),
-                            0,
-                            255
-                        );
-                    }
-
-                    image.setPixel(x, y, color);
-                    break;
-                }
+    // Animation: --animate <output> <frame>:<exponent>:<zoom>... around the center above, see FrameWriter
+    // for the outputs. Raw video plays with e.g. ffplay -f rawvideo -pixel_format rgba -video_size 1500x1500
+    if (argc >= 4 && std::string(argv[1]) == "--animate") {
+        std::vector<Keyframe> keyframes;
+        for (int i = 3; i < argc; ++i) {
+            Keyframe keyframe;
+            if (!parseKeyframe(argv[i], keyframe) || (!keyframes.empty() && keyframe.frame <= keyframes.back().frame)) {
+                std::cerr << "Bad keyframe " << argv[i] << ", expected increasing <frame>:<exponent>:<zoom>\n";
+                return 1;
             }
+            keyframes.push_back(keyframe);
+        }
+
+        FrameWriter writer(argv[2], windowSize.x, windowSize.y);
+        if (!writer.isOpen()) {
+            std::cerr << "Can't open " << argv[2] << "\n";
+            return 1;
         }
+        renderAnimation(keyframes, writer, windowSize, xCenter, yCenter, maxIterations);
+        return 0;
     }
 
+    // Deep zoom: --deep <x center> <y center> <zoom> <max iterations> [output.png]
+    // The centers are decimal text with as many digits as the zoom needs, the exponent is always 2.
+    if (argc >= 6 && std::string(argv[1]) == "--deep") {
+        zoom = std::stod(argv[4]);
+        maxIterations = std::stoi(argv[5]);
+        screenRadius = 1.5/zoom;
+
+        // 64 bits more than the pixel spacing needs
+        int limbCount = (int)std::ceil((std::log2(zoom) + std::log2(windowSize.x) + 64) / 32.0) + 1;
+        BigFixed centerX = BigFixed::parse(argv[2], limbCount);
+        BigFixed centerY = BigFixed::parse(argv[3], limbCount);
+        centerY.negative = !centerY.negative;
+
+        renderPerturbation(pixels, windowSize.x, windowSize.y, centerX, centerY, screenRadius, maxIterations);
+
+        if (argc >= 7) {
+            sf::Image output;
+            output.create(windowSize.x, windowSize.y, pixels.data());
+            output.saveToFile(argv[6]);
+            return 0;
+        }
+    } else {
+        renderMandelbrot(pixels, windowSize.x, windowSize.y, xMin, xMax, yMin, yMax, maxIterations, exponent);
+    }
+
+    sf::RenderWindow window(sf::VideoMode(windowSize.x, windowSize.y), "Mandelbrot set");
+
+    sf::Image image;
+    image.create(windowSize.x, windowSize.y, pixels.data());
+
     sf::Texture texture;
     texture.loadFromImage(image);
 
@@ -114,15 +991,6 @@ int main() {
             }
         }
 
-        // std::ostringstream filenameStream;
-        // filenameStream << "frames/frame_" << std::setw(4) << std::setfill('0') << frameCount << ".png";
-        // std::string filename = filenameStream.str();
-
-        // image.saveToFile(filename);
-
-        // exponent += 0.01;
-        // frameCount++;
-        
         window.clear();
         window.draw(sprite);
         window.display();
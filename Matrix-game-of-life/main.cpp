@@ -2,6 +2,16 @@
 #include <iostream>
 #include <random>
 #include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+#include <omp.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 
 sf::Color hueToColor(int hue)
@@ -30,12 +40,280 @@ sf::Color hueToColor(int hue)
 }
 
 
+// Square matrix on the heap, row-major
+struct Matrix {
+    int size;
+    std::vector<std::int32_t> values;
+
+    Matrix(int size_ = 0) {
+        size = size_;
+        values.assign(size * size, 0);
+    }
+
+    std::int32_t* row(int i) {
+        return &values[i * size];
+    }
+
+    const std::int32_t* row(int i) const {
+        return &values[i * size];
+    }
+};
+
+// Reduces values in [0, 2^24) mod modulus. The float division is exact enough to be off by at most one,
+// which the two corrections fix.
+inline void reduceRow(std::int32_t* values, int count, int modulus) {
+    int j = 0;
+#if defined(__AVX2__)
+    __m256 inverse = _mm256_set1_ps(1.0f / modulus);
+    __m256i m = _mm256_set1_epi32(modulus);
+    __m256i zero = _mm256_setzero_si256();
+    for (; j + 8 <= count; j += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)&values[j]);
+        __m256i q = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(x), inverse));
+        __m256i r = _mm256_sub_epi32(x, _mm256_mullo_epi32(q, m));
+        r = _mm256_add_epi32(r, _mm256_and_si256(m, _mm256_cmpgt_epi32(zero, r)));
+        r = _mm256_sub_epi32(r, _mm256_andnot_si256(_mm256_cmpgt_epi32(m, r), m));
+        _mm256_storeu_si256((__m256i*)&values[j], r);
+    }
+#endif
+    for (; j < count; ++j)
+        values[j] %= modulus;
+}
+
+// row += first * pairs[0, 2, ...] + second * pairs[1, 3, ...], the inner loop of the product.
+// _mm256_madd_epi16 does both multiplies and the add for 8 columns at once.
+inline void multiplyAddPairs(std::int32_t* row, const std::int16_t* pairs, std::int16_t first, std::int16_t second, int count) {
+    int j = 0;
+#if defined(__AVX2__)
+    __m256i factors = _mm256_set1_epi32((std::uint16_t)first | ((std::uint32_t)(std::uint16_t)second << 16));
+    for (; j + 8 <= count; j += 8) {
+        __m256i sum = _mm256_loadu_si256((const __m256i*)&row[j]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&pairs[j * 2]);
+        _mm256_storeu_si256((__m256i*)&row[j], _mm256_add_epi32(sum, _mm256_madd_epi16(b, factors)));
+    }
+#endif
+    for (; j < count; ++j)
+        row[j] += first * pairs[j * 2] + second * pairs[j * 2 + 1];
+}
+
+// result = a * b mod modulus, for entries already in [0, modulus) and modulus <= 2048.
+// b gets rewritten with every two rows interleaved as 16 bit pairs (b[k][j], b[k + 1][j]), so the
+// inner loop handles two k at once. Blocked i-k-j order, so the inner loop walks along rows of b and
+// result. The sums get reduced after every block of k, before they could leave the range reduceRow
+// handles, so any size works.
+void multiplyMod(const Matrix& a, const Matrix& b, Matrix& result, int modulus) {
+    const int n = a.size;
+    const int pairRows = (n + 1) / 2;
+    const int rowBlock = 16;
+    const int columnBlock = 512;
+    const int maxProduct = (modulus - 1) * (modulus - 1);
+    const int innerBlock = std::clamp(((1 << 24) - modulus) / std::max(1, maxProduct) / 2 * 2, 2, 1024);
+
+    static std::vector<std::int16_t> pairs;
+    pairs.assign(pairRows * n * 2, 0);
+    #pragma omp parallel for
+    for (int k = 0; k < n; ++k) {
+        std::int16_t* pair = &pairs[(k / 2) * n * 2 + k % 2];
+        const std::int32_t* bRow = b.row(k);
+        for (int j = 0; j < n; ++j)
+            pair[j * 2] = bRow[j];
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int ii = 0; ii < n; ii += rowBlock) {
+        int iEnd = std::min(ii + rowBlock, n);
+        for (int i = ii; i < iEnd; ++i)
+            std::fill_n(result.row(i), n, 0);
+
+        for (int kk = 0; kk < n; kk += innerBlock) {
+            int kEnd = std::min(kk + innerBlock, n);
+            for (int jj = 0; jj < n; jj += columnBlock) {
+                int count = std::min(columnBlock, n - jj);
+                for (int i = ii; i < iEnd; ++i) {
+                    const std::int32_t* aRow = a.row(i);
+                    std::int32_t* resultRow = result.row(i) + jj;
+                    for (int k = kk; k < kEnd; k += 2) {
+                        std::int16_t first = aRow[k];
+                        std::int16_t second = k + 1 < n ? aRow[k + 1] : 0;
+                        // The starting matrix is mostly zeros and ones
+                        if (first != 0 || second != 0)
+                            multiplyAddPairs(resultRow, &pairs[(k / 2) * n * 2 + jj * 2], first, second, count);
+                    }
+                }
+            }
+
+            for (int i = ii; i < iEnd; ++i)
+                reduceRow(result.row(i), n, modulus);
+        }
+    }
+}
+
+// Square of a matrix with entries mod Modulus, in narrow integers. The sums are uint8 for 8, where
+// wrapping around at 256 doesn't change anything mod 8, and uint16 for 9 and 5, reduced before
+// they could overflow. Blocks of rows share every row of a while it's in cache.
+template <int Modulus, class Sum>
+void squareSmallMod(const std::vector<std::uint8_t>& a, std::vector<std::uint8_t>& result, int n) {
+    constexpr bool wraps = sizeof(Sum) == 1 && 256 % Modulus == 0;
+    constexpr int maxProduct = (Modulus - 1) * (Modulus - 1);
+    constexpr int reduceEvery = wraps ? std::numeric_limits<int>::max() : std::numeric_limits<Sum>::max() / maxProduct - 1;
+    const int rowBlock = 32;
+
+    result.resize(n * n);
+    #pragma omp parallel
+    {
+        std::vector<Sum> sums(rowBlock * n);
+
+        #pragma omp for schedule(dynamic)
+        for (int ii = 0; ii < n; ii += rowBlock) {
+            int rows = std::min(rowBlock, n - ii);
+            std::fill(sums.begin(), sums.end(), 0);
+
+            for (int k = 0; k < n; ++k) {
+                const std::uint8_t* bRow = &a[k * n];
+                for (int r = 0; r < rows; ++r) {
+                    Sum factor = a[(ii + r) * n + k];
+                    if (factor == 0)
+                        continue;
+                    Sum* sum = &sums[r * n];
+                    #pragma omp simd
+                    for (int j = 0; j < n; ++j)
+                        sum[j] += (Sum)(factor * bRow[j]);
+                }
+
+                if ((k + 1) % reduceEvery == 0) {
+                    for (int j = 0; j < rows * n; ++j)
+                        sums[j] %= Modulus;
+                }
+            }
+
+            for (int j = 0; j < rows * n; ++j)
+                result[ii * n + j] = sums[j] % Modulus;
+        }
+    }
+}
+
+// One of the CRT components of the squaring sequence, which has to run into a cycle eventually
+struct SquaringSequence {
+    int modulus;
+    int size;
+    std::vector<std::uint8_t> start;
+    void (*square)(const std::vector<std::uint8_t>&, std::vector<std::uint8_t>&, int);
+
+    bool cycleFound = false;
+    unsigned long long prePeriod = 0;
+    unsigned long long period = 0;
+
+    // Generation k of this component. Looks for the cycle on the way, so once it's known any k works.
+    std::vector<std::uint8_t> generation(unsigned long long k) {
+        if (cycleFound)
+            return walk(reduce(k));
+
+        std::unordered_map<std::uint64_t, unsigned long long> seen;
+        std::vector<std::uint8_t> current = start;
+        std::vector<std::uint8_t> next;
+        for (unsigned long long t = 0; t < k; ++t) {
+            auto found = seen.find(hash(current));
+            if (found != seen.end() && walk(found->second) == current) {
+                cycleFound = true;
+                prePeriod = found->second;
+                period = t - found->second;
+                return walk(reduce(k));
+            }
+            seen.emplace(hash(current), t);
+
+            square(current, next, size);
+            std::swap(current, next);
+        }
+        return current;
+    }
+
+    private:
+    unsigned long long reduce(unsigned long long k) const {
+        return k < prePeriod ? k : prePeriod + (k - prePeriod) % period;
+    }
+
+    // Squares the start matrix steps times
+    std::vector<std::uint8_t> walk(unsigned long long steps) const {
+        std::vector<std::uint8_t> current = start;
+        std::vector<std::uint8_t> next;
+        for (unsigned long long t = 0; t < steps; ++t) {
+            square(current, next, size);
+            std::swap(current, next);
+        }
+        return current;
+    }
+
+    static std::uint64_t hash(const std::vector<std::uint8_t>& values) {
+        std::uint64_t h = 1469598103934665603ull;
+        for (std::uint8_t v : values)
+            h = (h ^ v) * 1099511628211ull;
+        return h;
+    }
+};
+
+// Generation k is the start matrix to the power 2^k mod 360. 360 = 8 * 9 * 5, and mod each of those
+// the entries fit in a byte and the sums in 8 or 16 bits. The three parts are put back together with
+// the Chinese remainder theorem.
+class GenerationJumper {
+    public:
+        SquaringSequence components[3];
+
+    GenerationJumper(const Matrix& start) {
+        int moduli[3] = {8, 9, 5};
+        void (*squares[3])(const std::vector<std::uint8_t>&, std::vector<std::uint8_t>&, int) = {
+            squareSmallMod<8, std::uint8_t>, squareSmallMod<9, std::uint16_t>, squareSmallMod<5, std::uint16_t>};
+        for (int c = 0; c < 3; ++c) {
+            components[c].modulus = moduli[c];
+            components[c].size = start.size;
+            components[c].square = squares[c];
+            components[c].start.resize(start.size * start.size);
+            for (int i = 0; i < start.size * start.size; ++i)
+                components[c].start[i] = start.values[i] % moduli[c];
+        }
+
+        // x = 225 * (x mod 8) + 280 * (x mod 9) + 216 * (x mod 5) mod 360
+        for (int r8 = 0; r8 < 8; ++r8)
+            for (int r9 = 0; r9 < 9; ++r9)
+                for (int r5 = 0; r5 < 5; ++r5)
+                    combine[r8][r9][r5] = (225 * r8 + 280 * r9 + 216 * r5) % 360;
+    }
+
+    void generation(unsigned long long k, Matrix& result) {
+        std::vector<std::uint8_t> parts[3];
+        for (int c = 0; c < 3; ++c)
+            parts[c] = components[c].generation(k);
+
+        #pragma omp parallel for
+        for (int i = 0; i < result.size * result.size; ++i)
+            result.values[i] = combine[parts[0][i]][parts[1][i]][parts[2][i]];
+    }
+
+    bool cycleFound() const {
+        return components[0].cycleFound && components[1].cycleFound && components[2].cycleFound;
+    }
+
+    // The whole sequence repeats once all three parts do
+    unsigned long long prePeriod() const {
+        return std::max({components[0].prePeriod, components[1].prePeriod, components[2].prePeriod});
+    }
+
+    unsigned long long period() const {
+        return std::lcm(std::lcm(components[0].period, components[1].period), components[2].period);
+    }
+
+    private:
+        std::int16_t combine[8][9][5];
+};
+
 int main() {
     int screenSize = 1000;
-    int simulationSize = 50;
+    int simulationSize;
+    std::cout << "Simulation size: ";
+    std::cin >> simulationSize;
 
-    int oldCellStates[simulationSize][simulationSize];
-    int cellStates[simulationSize][simulationSize];
+    const int cap = 360;
+    Matrix oldCellStates(simulationSize);
+    Matrix cellStates(simulationSize);
 
     bool paused = false;
     
@@ -50,10 +328,9 @@ int main() {
     window.setFramerateLimit(1);
 
 
-    sf::Image image;
-    image.create(simulationSize, simulationSize);
+    std::vector<sf::Uint8> pixels(simulationSize * simulationSize * 4, 255);
     sf::Texture texture;
-    texture.loadFromImage(image);
+    texture.create(simulationSize, simulationSize);
     sf::Sprite sprite;
     float scale = (float) screenSize / (float) simulationSize;
     sprite.setScale(scale, scale);
@@ -61,45 +338,59 @@ int main() {
     for (int x = 0; x < simulationSize; x++) {
         for (int y = 0; y < simulationSize; y++) {
             int random = dist(gen);
-            cellStates[x][y] = random;
-            oldCellStates[x][y] = random;
+            cellStates.row(x)[y] = random;
+            oldCellStates.row(x)[y] = random;
         }
     }
 
+    // J jumps to any generation, counted from the starting matrix
+    unsigned long long generation = 0;
+    GenerationJumper jumper(oldCellStates);
+
+    auto showMatrix = [&](const Matrix& matrix) {
+        #pragma omp parallel for
+        for (int x = 0; x < simulationSize; x++) {
+            for (int y = 0; y < simulationSize; y++) {
+                sf::Uint8 color = (matrix.row(x)[y] < cap/2.0) ? 255 : 0;
+                sf::Uint8* pixel = &pixels[(y * simulationSize + x) * 4];
+                pixel[0] = color;
+                pixel[1] = color;
+                pixel[2] = color;
+            }
+        }
+    };
 
     while (window.isOpen()) {
+        // Shows the generation jumped to for a frame before going on from there
+        bool jumped = false;
         sf::Event event;
         while (window.pollEvent(event)) {
             if (event.type == sf::Event::Closed) {
                 window.close();
             }
-        }
+            if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::J) {
+                std::cout << "Jump to generation: ";
+                std::cin >> generation;
 
-        if (!paused) {
-            for (int x = 0; x < simulationSize; x++) {
-                for (int y = 0; y < simulationSize; y++) {
-                    cellStates[x][y] = 0;
-                    for (int i = 0; i < simulationSize; i++) {
-                        cellStates[x][y] += oldCellStates[x][i] * oldCellStates[i][y];
-                    }
-
-                    int cap = 360;
-                    cellStates[x][y] %= cap;
-                    sf::Color color = (cellStates[x][y] < cap/2.0) ? sf::Color::White : sf::Color::Black;
-                    image.setPixel(x, y, color);
+                jumper.generation(generation, oldCellStates);
+                showMatrix(oldCellStates);
+                if (jumper.cycleFound()) {
+                    std::cout << "pre-period " << jumper.prePeriod() << ", period " << jumper.period() << "\n";
+                } else {
+                    std::cout << "no cycle within " << generation << " generations yet\n";
                 }
+                jumped = true;
             }
+        }
 
-            for (int x = 0; x < simulationSize; x++)
-            {
-                for (int y = 0; y < simulationSize; y++) {
-                    oldCellStates[x][y] = cellStates[x][y];
-                }
-            }
-            
+        if (!paused && !jumped) {
+            multiplyMod(oldCellStates, oldCellStates, cellStates, cap);
+            generation++;
+            showMatrix(cellStates);
+            std::swap(oldCellStates, cellStates);
         }
 
-        texture.update(image);
+        texture.update(pixels.data());
         sprite.setTexture(texture);
 
         window.clear();
@@ -4,31 +4,182 @@
 #include <string>
 #include <iostream>
 #include <random>
+#include <algorithm>
 #include <omp.h>
 #include <chrono>
+#include <new>
+#include <cstring>
+#include "../circle-batch.h"
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Starts every array on a cache line, so threads that work on chunks of 16 floats never share one
+template <typename T>
+struct CacheAlignedAllocator {
+    typedef T value_type;
+
+    CacheAlignedAllocator() {}
+    template <typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(64)));
+    }
+    void deallocate(T* p, std::size_t) {
+        ::operator delete(p, std::align_val_t(64));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) { return true; }
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, CacheAlignedAllocator<T>>;
 
-class Particle {
+// Particles handed to one thread at a time, a multiple of 16 so no cache line is written by two threads
+const int particlesPerChunk = 256;
+
+// Structure-of-arrays particle storage, so the force kernel can load a whole row of neighbours at once
+class ParticleStore {
     public:
-        sf::Vector2f position;
-        sf::Vector2f velocity;
-
-        int radius;
-        int color;
-        bool nearLeftEdge;
-        bool nearRightEdge;
-        bool nearTopEdge;
-        bool nearBottomEdge;
-
-    Particle() {
-        position = sf::Vector2f(0, 0);
-        velocity = sf::Vector2f(0, 0);
-
-        color = 0;
-        radius = 2;
-        nearLeftEdge = false;
-        nearRightEdge = false;
-        nearTopEdge = false;
-        nearBottomEdge = false;
+        AlignedVector<float> x;
+        AlignedVector<float> y;
+        AlignedVector<float> vx;
+        AlignedVector<float> vy;
+        AlignedVector<int> color;
+
+    int size() const {
+        return x.size();
+    }
+
+    void resize(int count) {
+        x.resize(count);
+        y.resize(count);
+        vx.resize(count);
+        vy.resize(count);
+        color.resize(count);
+    }
+
+    void add(sf::Vector2f position, int color_) {
+        x.push_back(position.x);
+        y.push_back(position.y);
+        vx.push_back(0.0f);
+        vy.push_back(0.0f);
+        color.push_back(color_);
+    }
+};
+
+// Uniform grid over the wrapped screen. Cells are at least maxDistance wide, so every
+// particle that can interact with a given particle lives in the 3x3 block of cells around it.
+class SpatialGrid {
+    public:
+        int columns;
+        int rows;
+        float cellWidth;
+        float cellHeight;
+        float worldWidth;
+        float worldHeight;
+
+        std::vector<int> cellStart; // cellStart[c] .. cellStart[c + 1] is the range of cell c in the particle store
+        std::vector<int> particleCell;
+        std::vector<int> threadCellCount;
+
+    SpatialGrid(float worldWidth_, float worldHeight_, float minCellSize) {
+        worldWidth = worldWidth_;
+        worldHeight = worldHeight_;
+
+        columns = std::max(1, (int)(worldWidth / minCellSize));
+        rows = std::max(1, (int)(worldHeight / minCellSize));
+        cellWidth = worldWidth / columns;
+        cellHeight = worldHeight / rows;
+
+        cellStart.assign(columns * rows + 1, 0);
+    }
+
+    int cellIndex(float x, float y) const {
+        int cx = std::clamp((int)(x / cellWidth), 0, columns - 1);
+        int cy = std::clamp((int)(y / cellHeight), 0, rows - 1);
+        return cy * columns + cx;
+    }
+
+    // Stable counting sort of the particles by cell into sorted, so every cell becomes a contiguous range.
+    // Every thread counts and scatters its own slice; since the sort is stable the order doesn't depend on the thread count.
+    void build(const ParticleStore& particles, ParticleStore& sorted) {
+        int particleCount = particles.size();
+        int cellCount = columns * rows;
+        particleCell.resize(particleCount);
+        sorted.resize(particleCount);
+
+        #pragma omp parallel
+        {
+            int threadCount = omp_get_num_threads();
+            int thread = omp_get_thread_num();
+            int sliceBegin = (long long)particleCount * thread / threadCount;
+            int sliceEnd = (long long)particleCount * (thread + 1) / threadCount;
+
+            #pragma omp single
+            threadCellCount.assign((std::size_t)threadCount * cellCount, 0);
+
+            int* counts = &threadCellCount[(std::size_t)thread * cellCount];
+            for (int i = sliceBegin; i < sliceEnd; ++i) {
+                particleCell[i] = cellIndex(particles.x[i], particles.y[i]);
+                counts[particleCell[i]]++;
+            }
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                // Turn the counts into the first slot of every (cell, thread) pair
+                int offset = 0;
+                for (int c = 0; c < cellCount; ++c) {
+                    cellStart[c] = offset;
+                    for (int t = 0; t < threadCount; ++t) {
+                        int count = threadCellCount[(std::size_t)t * cellCount + c];
+                        threadCellCount[(std::size_t)t * cellCount + c] = offset;
+                        offset += count;
+                    }
+                }
+                cellStart[cellCount] = offset;
+            }
+
+            for (int i = sliceBegin; i < sliceEnd; ++i) {
+                int k = counts[particleCell[i]]++;
+                sorted.x[k] = particles.x[i];
+                sorted.y[k] = particles.y[i];
+                sorted.vx[k] = particles.vx[i];
+                sorted.vy[k] = particles.vy[i];
+                sorted.color[k] = particles.color[i];
+            }
+        }
+    }
+
+    // Calls f(begin, end, shiftX, shiftY) for every cell in the 3x3 block around (x, y).
+    // The shift is the periodic image offset that has to be added to the positions in that cell.
+    template <typename Function>
+    void forEachNeighborCell(float x, float y, Function f) const {
+        int cell = cellIndex(x, y);
+        int cx = cell % columns;
+        int cy = cell / columns;
+
+        for (int dy = -1; dy <= 1; ++dy) {
+            int ny = cy + dy;
+            float shiftY = 0.0f;
+            if (ny < 0) { ny += rows; shiftY = -worldHeight; }
+            else if (ny >= rows) { ny -= rows; shiftY = worldHeight; }
+
+            for (int dx = -1; dx <= 1; ++dx) {
+                int nx = cx + dx;
+                float shiftX = 0.0f;
+                if (nx < 0) { nx += columns; shiftX = -worldWidth; }
+                else if (nx >= columns) { nx -= columns; shiftX = worldWidth; }
+
+                int neighborCell = ny * columns + nx;
+                f(cellStart[neighborCell], cellStart[neighborCell + 1], shiftX, shiftY);
+            }
+        }
     }
 };
 
@@ -36,25 +187,17 @@ sf::Vector2f normalized(sf::Vector2f vec) {
     return vec / (float) hypot(vec.x, vec.y);
 }
 
-void interact(Particle& particle1, const Particle& particle2, const std::vector<std::vector<float>>* attractionMatrix, int maxDistance = 100, int minDistance = 20, float manualForce = 5.0) {
-    float attraction;
-
-    if (attractionMatrix == nullptr) {
-        attraction = manualForce;
-    } else {
-        attraction = (*attractionMatrix)[particle1.color][particle2.color];
-    }
-    // direction
-    sf::Vector2f diff = particle2.position - particle1.position;
+// Force on a particle from another one at offset diff
+inline sf::Vector2f interact(sf::Vector2f diff, float attraction, int maxDistance = 100, int minDistance = 20) {
     float distSq = diff.x * diff.x + diff.y * diff.y;
     float dist = std::sqrt(distSq);
-        if (dist > maxDistance) {
-        return;
+    if (dist > maxDistance) {
+        return sf::Vector2f(0, 0);
     }
 
     if (distSq > 5) { // avoid division by zero
         sf::Vector2f dir = diff / dist;
-        
+
         float force;
 
         float a = attraction/(maxDistance-minDistance);
@@ -65,13 +208,309 @@ void interact(Particle& particle1, const Particle& particle2, const std::vector<
         else if (dist < maxDistance/2 + minDistance/2) {
             force = a*dist - a*minDistance;
         }
-        else if (dist <= maxDistance) {
+        else {
             force = -a*dist + a*maxDistance;
         }
 
-        force *= 1.0;
-        // Apply force to particle1’s velocity
-        particle1.velocity += dir * force;
+        return dir * force;
+    }
+    return sf::Vector2f(0, 0);
+}
+
+// Sums the forces on particle i from the particles [begin, end) of the store, shifted by (shiftX, shiftY).
+// Does the same as calling interact() for each of them, 8 (AVX2) or 16 (AVX-512) neighbours at a time.
+void accumulateForces(const ParticleStore& particles, int i, int begin, int end, float shiftX, float shiftY,
+                      const float* attractionRow, int maxDistance, int minDistance, float& forceX, float& forceY) {
+    // (x[j] + shift) - x[i] == x[j] - (x[i] - shift)
+    float px = particles.x[i] - shiftX;
+    float py = particles.y[i] - shiftY;
+    int j = begin;
+
+#if defined(__AVX512F__)
+    const __m512 vpx = _mm512_set1_ps(px);
+    const __m512 vpy = _mm512_set1_ps(py);
+    const __m512 vMax = _mm512_set1_ps(maxDistance);
+    const __m512 vMin = _mm512_set1_ps(minDistance);
+    const __m512 vMid = _mm512_set1_ps(maxDistance/2 + minDistance/2);
+    const __m512 vRange = _mm512_set1_ps(maxDistance - minDistance);
+    const __m512 vTwo = _mm512_set1_ps(2.0f);
+    const __m512 vEpsilon = _mm512_set1_ps(5.0f);
+    __m512 sumX = _mm512_setzero_ps();
+    __m512 sumY = _mm512_setzero_ps();
+
+    for (; j < end; j += 16) {
+        __mmask16 lanes = (end - j >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (end - j)) - 1);
+
+        __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, &particles.x[j]), vpx);
+        __m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, &particles.y[j]), vpy);
+        __m512 distSq = _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy));
+        __m512 dist = _mm512_sqrt_ps(distSq);
+
+        __m512i colors = _mm512_maskz_loadu_epi32(lanes, &particles.color[j]);
+        __m512 attraction = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), lanes, colors, attractionRow, 4);
+        __m512 a = _mm512_div_ps(attraction, vRange);
+
+        __m512 repel = _mm512_sub_ps(_mm512_mul_ps(_mm512_div_ps(dist, vMin), vTwo), vTwo);
+        __m512 rise = _mm512_sub_ps(_mm512_mul_ps(a, dist), _mm512_mul_ps(a, vMin));
+        __m512 fall = _mm512_sub_ps(_mm512_mul_ps(a, vMax), _mm512_mul_ps(a, dist));
+
+        __m512 force = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(dist, vMid, _CMP_LT_OQ), fall, rise);
+        force = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(dist, vMin, _CMP_LT_OQ), force, repel);
+
+        __mmask16 active = lanes
+            & _mm512_cmp_ps_mask(dist, vMax, _CMP_LE_OQ)
+            & _mm512_cmp_ps_mask(distSq, vEpsilon, _CMP_GT_OQ);
+        __m512 scale = _mm512_maskz_div_ps(active, force, dist);
+
+        sumX = _mm512_add_ps(sumX, _mm512_mul_ps(dx, scale));
+        sumY = _mm512_add_ps(sumY, _mm512_mul_ps(dy, scale));
+    }
+    forceX += _mm512_reduce_add_ps(sumX);
+    forceY += _mm512_reduce_add_ps(sumY);
+#elif defined(__AVX2__)
+    const __m256 vpx = _mm256_set1_ps(px);
+    const __m256 vpy = _mm256_set1_ps(py);
+    const __m256 vMax = _mm256_set1_ps(maxDistance);
+    const __m256 vMin = _mm256_set1_ps(minDistance);
+    const __m256 vMid = _mm256_set1_ps(maxDistance/2 + minDistance/2);
+    const __m256 vRange = _mm256_set1_ps(maxDistance - minDistance);
+    const __m256 vTwo = _mm256_set1_ps(2.0f);
+    const __m256 vEpsilon = _mm256_set1_ps(5.0f);
+    __m256 sumX = _mm256_setzero_ps();
+    __m256 sumY = _mm256_setzero_ps();
+
+    for (; j + 8 <= end; j += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&particles.x[j]), vpx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&particles.y[j]), vpy);
+        __m256 distSq = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 dist = _mm256_sqrt_ps(distSq);
+
+        __m256i colors = _mm256_loadu_si256((const __m256i*)&particles.color[j]);
+        __m256 attraction = _mm256_i32gather_ps(attractionRow, colors, 4);
+        __m256 a = _mm256_div_ps(attraction, vRange);
+
+        __m256 repel = _mm256_sub_ps(_mm256_mul_ps(_mm256_div_ps(dist, vMin), vTwo), vTwo);
+        __m256 rise = _mm256_sub_ps(_mm256_mul_ps(a, dist), _mm256_mul_ps(a, vMin));
+        __m256 fall = _mm256_sub_ps(_mm256_mul_ps(a, vMax), _mm256_mul_ps(a, dist));
+
+        __m256 force = _mm256_blendv_ps(fall, rise, _mm256_cmp_ps(dist, vMid, _CMP_LT_OQ));
+        force = _mm256_blendv_ps(force, repel, _mm256_cmp_ps(dist, vMin, _CMP_LT_OQ));
+
+        __m256 active = _mm256_and_ps(
+            _mm256_cmp_ps(dist, vMax, _CMP_LE_OQ),
+            _mm256_cmp_ps(distSq, vEpsilon, _CMP_GT_OQ));
+        __m256 scale = _mm256_and_ps(active, _mm256_div_ps(force, dist));
+
+        sumX = _mm256_add_ps(sumX, _mm256_mul_ps(dx, scale));
+        sumY = _mm256_add_ps(sumY, _mm256_mul_ps(dy, scale));
+    }
+
+    float lanesX[8];
+    float lanesY[8];
+    _mm256_storeu_ps(lanesX, sumX);
+    _mm256_storeu_ps(lanesY, sumY);
+    for (int k = 0; k < 8; ++k) {
+        forceX += lanesX[k];
+        forceY += lanesY[k];
+    }
+#endif
+
+    for (; j < end; ++j) {
+        sf::Vector2f force = interact(sf::Vector2f(particles.x[j] - px, particles.y[j] - py), attractionRow[particles.color[j]], maxDistance, minDistance);
+        forceX += force.x;
+        forceY += force.y;
+    }
+}
+
+// Wall time spent in each phase of a step, summed over steps, in nanoseconds
+struct PhaseTimings {
+    double wrap = 0;
+    double sort = 0;
+    double force = 0;
+    double integrate = 0;
+    double draw = 0;
+    long long particleSteps = 0;
+
+    // One JSON object per line, in ns per particle per step
+    void print(std::ostream& out) const {
+        double n = std::max(1LL, particleSteps);
+        out << "{\"wrap\":" << wrap / n
+            << ",\"sort\":" << sort / n
+            << ",\"force\":" << force / n
+            << ",\"integrate\":" << integrate / n
+            << ",\"draw\":" << draw / n
+            << ",\"total\":" << (wrap + sort + force + integrate + draw) / n
+            << "}";
+    }
+};
+
+double nanosecondsSince(std::chrono::high_resolution_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// A particle life world. The force and integrate phases only read from particles and only write to
+// per-particle slots of forceX/forceY and next, so a step gives the same bits for any number of threads.
+class ParticleSimulation {
+    public:
+        ParticleStore particles;
+        ParticleStore next;
+        AlignedVector<float> forceX;
+        AlignedVector<float> forceY;
+        SpatialGrid grid;
+
+        // attractionMatrix[i * colorsAmount + j] is how much color i is attracted to color j
+        std::vector<float> attractionMatrix;
+        int colorsAmount;
+        int width;
+        int height;
+        int maxDistance;
+        int minDistance;
+
+    ParticleSimulation(int width_, int height_, int colorsAmount_, int maxDistance_ = 200, int minDistance_ = 20)
+        : grid(width_, height_, maxDistance_) {
+        width = width_;
+        height = height_;
+        colorsAmount = colorsAmount_;
+        maxDistance = maxDistance_;
+        minDistance = minDistance_;
+        attractionMatrix.assign(colorsAmount * colorsAmount, 1.0f);
+    }
+
+    // Wrap particles around the screen
+    void wrapEdges() {
+        #pragma omp parallel for schedule(static, particlesPerChunk)
+        for (int i = 0; i < particles.size(); ++i) {
+            if (particles.x[i] < 0) {
+                particles.x[i] = width - 0.01f;
+            }
+            if (particles.x[i] > width) {
+                particles.x[i] = 0.01f;
+            }
+            if (particles.y[i] < 0) {
+                particles.y[i] = height - 0.01f;
+            }
+            if (particles.y[i] > height) {
+                particles.y[i] = 0.01f;
+            }
+        }
+    }
+
+    void sortIntoCells() {
+        grid.build(particles, next);
+        std::swap(particles, next);
+    }
+
+    // cursorForce is the attraction towards (or away from, when negative) the cursor and its wrapped copies
+    void computeForces(sf::Vector2f cursorPosition, float cursorForce, int cursorRange) {
+        forceX.resize(particles.size());
+        forceY.resize(particles.size());
+
+        const sf::Vector2f cursorShifts[5] = {
+            sf::Vector2f(0, 0),
+            sf::Vector2f(width, 0),
+            sf::Vector2f(-width, 0),
+            sf::Vector2f(0, height),
+            sf::Vector2f(0, -height)
+        };
+
+        // Dynamic, since clustered particles make some chunks a lot more expensive than others
+        #pragma omp parallel for schedule(dynamic, particlesPerChunk)
+        for (int i = 0; i < particles.size(); ++i) {
+            float sumX = 0.0f;
+            float sumY = 0.0f;
+            const float* attractionRow = &attractionMatrix[particles.color[i] * colorsAmount];
+
+            // The grid hands out the wrapped copies of the cells across the edges
+            grid.forEachNeighborCell(particles.x[i], particles.y[i], [&](int begin, int end, float shiftX, float shiftY) {
+                accumulateForces(particles, i, begin, end, shiftX, shiftY, attractionRow, maxDistance, minDistance, sumX, sumY);
+            });
+
+            if (cursorForce != 0.0f) {
+                for (const sf::Vector2f &shift : cursorShifts) {
+                    sf::Vector2f diff = cursorPosition + shift - sf::Vector2f(particles.x[i], particles.y[i]);
+                    sf::Vector2f force = interact(diff, cursorForce, cursorRange, 0);
+                    sumX += force.x;
+                    sumY += force.y;
+                }
+            }
+
+            forceX[i] = sumX;
+            forceY[i] = sumY;
+        }
+    }
+
+    void integrate() {
+        next.resize(particles.size());
+
+        #pragma omp parallel for schedule(static, particlesPerChunk)
+        for (int i = 0; i < particles.size(); ++i) {
+            next.vx[i] = (particles.vx[i] + forceX[i]) * 0.8f;
+            next.vy[i] = (particles.vy[i] + forceY[i]) * 0.8f;
+            next.x[i] = particles.x[i] + next.vx[i] * 1.0f;
+            next.y[i] = particles.y[i] + next.vy[i] * 1.0f;
+            next.color[i] = particles.color[i];
+        }
+        std::swap(particles, next);
+    }
+
+    void step(sf::Vector2f cursorPosition = sf::Vector2f(0, 0), float cursorForce = 0.0f, int cursorRange = 0, PhaseTimings* timings = nullptr) {
+        if (timings == nullptr) {
+            wrapEdges();
+            sortIntoCells();
+            computeForces(cursorPosition, cursorForce, cursorRange);
+            integrate();
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        wrapEdges();
+        timings->wrap += nanosecondsSince(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        sortIntoCells();
+        timings->sort += nanosecondsSince(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        computeForces(cursorPosition, cursorForce, cursorRange);
+        timings->force += nanosecondsSince(start);
+
+        start = std::chrono::high_resolution_clock::now();
+        integrate();
+        timings->integrate += nanosecondsSince(start);
+
+        timings->particleSteps += particles.size();
+    }
+
+    // FNV-1a over the position bits, to compare runs
+    unsigned long long checksum() const {
+        unsigned long long hash = 1469598103934665603ULL;
+        for (int i = 0; i < particles.size(); ++i) {
+            for (float value : {particles.x[i], particles.y[i]}) {
+                unsigned int bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                hash = (hash ^ bits) * 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+};
+
+void randomizeAttraction(ParticleSimulation& simulation, std::mt19937& gen) {
+    std::uniform_real_distribution<float> rand_attraction(-1.0f, 1.0f);
+    for (float &value : simulation.attractionMatrix) {
+        value = rand_attraction(gen);
+    }
+}
+
+void populate(ParticleSimulation& simulation, int particleAmount, std::mt19937& gen) {
+    std::uniform_int_distribution<> rand_width(1, simulation.width);
+    std::uniform_int_distribution<> rand_height(1, simulation.height);
+    std::uniform_int_distribution<> rand_color(0, simulation.colorsAmount - 1);
+
+    randomizeAttraction(simulation, gen);
+    for (int i = 0; i < particleAmount; ++i) {
+        sf::Vector2f position(rand_width(gen), rand_height(gen));
+        simulation.particles.add(position, rand_color(gen));
     }
 }
 
@@ -102,7 +541,69 @@ sf::Vector3f hueToRGB(float h)
     return sf::Vector3f(r, g, b);
 }
 
-int main() {
+// One color per color index, evenly spread over the hue circle
+std::vector<sf::Color> colorPalette(int colorsAmount) {
+    std::vector<sf::Color> palette;
+    for (int c = 0; c < colorsAmount; ++c) {
+        sf::Vector3f rgb = hueToRGB((float)c / (float)colorsAmount);
+        palette.push_back(sf::Color(rgb.x * 255, rgb.y * 255, rgb.z * 255));
+    }
+    return palette;
+}
+
+void fillBatch(CircleBatch& batch, const ParticleStore& particles, float radius) {
+    batch.resize(particles.size());
+
+    #pragma omp parallel for schedule(static, particlesPerChunk)
+    for (int i = 0; i < particles.size(); ++i) {
+        batch.set(i, sf::Vector2f(particles.x[i], particles.y[i]), radius, particles.color[i]);
+    }
+}
+
+// Runs without a window and prints the phase timings as one JSON line, e.g.
+// ./particlelife --headless 20000 6 42 500
+int runHeadless(int particleAmount, int colorsAmount, unsigned int seed, int steps, int width, int height) {
+    std::mt19937 gen(seed);
+    ParticleSimulation simulation(width, height, colorsAmount);
+    populate(simulation, particleAmount, gen);
+
+    // Only fills the vertex array, there is nothing to draw it to
+    CircleBatch batch;
+    batch.palette = colorPalette(colorsAmount);
+
+    PhaseTimings timings;
+    for (int i = 0; i < steps; ++i) {
+        simulation.step(sf::Vector2f(0, 0), 0.0f, 0, &timings);
+
+        auto drawStart = std::chrono::high_resolution_clock::now();
+        fillBatch(batch, simulation.particles, 2);
+        timings.draw += nanosecondsSince(drawStart);
+    }
+
+    std::cout << "{\"particles\":" << particleAmount
+              << ",\"colors\":" << colorsAmount
+              << ",\"seed\":" << seed
+              << ",\"steps\":" << steps
+              << ",\"width\":" << width
+              << ",\"height\":" << height
+              << ",\"threads\":" << omp_get_max_threads()
+              << ",\"ns_per_particle_step\":";
+    timings.print(std::cout);
+    std::cout << ",\"checksum\":\"" << std::hex << simulation.checksum() << std::dec << "\"}\n";
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--headless") {
+        if (argc != 6 && argc != 8) {
+            std::cerr << "usage: " << argv[0] << " --headless <particles> <colors> <seed> <steps> [width height]\n";
+            return 1;
+        }
+        int width = (argc == 8) ? std::stoi(argv[6]) : 1920;
+        int height = (argc == 8) ? std::stoi(argv[7]) : 1080;
+        return runHeadless(std::stoi(argv[2]), std::stoi(argv[3]), std::stoul(argv[4]), std::stoi(argv[5]), width, height);
+    }
+
     sf::VideoMode desktop = sf::VideoMode::getDesktopMode();
     int screenWidth = desktop.width;
     int screenHeight = desktop.height;
@@ -111,47 +612,33 @@ int main() {
     std::cout << "\nPartice amount: ";
     std::cin >> particleAmount;
 
-    std::vector<Particle> particles;
-
     int maxDistance = 200;
-    
+    int particleRadius = 2;
+
     int colorsAmount;
     std::cout << "\nColor amount: ";
     std::cin >> colorsAmount;
 
     // Create a random device (used to seed)
     std::random_device rd;
-    
+
     // Use Mersenne Twister engine with the seed
     std::mt19937 gen(rd());
-    
-    // Define a distribution, e.g., uniform distribution between 1 and 100
-    std::uniform_int_distribution<> rand_width(1, screenWidth);
-    std::uniform_int_distribution<> rand_height(1, screenHeight);
-    std::uniform_int_distribution<> rand_color(0, colorsAmount - 1);
-    std::uniform_real_distribution<float> rand_attraction(-1.0f, 1.0f);
 
-    std::vector<std::vector<float>> attractionMatrix(colorsAmount, std::vector<float>(colorsAmount, 1.0f));
-
-    for (int i = 0; i < colorsAmount; ++i) {
-        for (int j = 0; j < colorsAmount; ++j) {
-            float value = rand_attraction(gen);
-            attractionMatrix.at(i).at(j) = value;
-        }
-    }
-
-    for (int i = 0; i < particleAmount; ++i) {
-        Particle particle;
-        particle.position = sf::Vector2f(rand_width(gen), rand_height(gen));
-        particle.color = rand_color(gen);
-        particles.push_back(particle);
-    }
+    ParticleSimulation simulation(screenWidth, screenHeight, colorsAmount, maxDistance);
+    populate(simulation, particleAmount, gen);
 
     sf::RenderWindow window;
     window.create(sf::VideoMode(screenWidth, screenHeight), "particle life wooooo", sf::Style::Fullscreen);
     window.setFramerateLimit(30);
 
-    Particle cursorParticle;
+    CircleBatch batch;
+    batch.palette = colorPalette(colorsAmount);
+
+    // T toggles printing the phase timings every 30 frames
+    bool printTimings = false;
+    PhaseTimings timings;
+    int timedFrames = 0;
 
     while (window.isOpen()) {
         sf::Event event;
@@ -161,12 +648,12 @@ int main() {
             }
             if (event.type == sf::Event::KeyPressed) {
                 if (event.key.code == sf::Keyboard::R) {
-                    for (int i = 0; i < colorsAmount; ++i) {
-                        for (int j = 0; j < colorsAmount; ++j) {
-                            float value = rand_attraction(gen);
-                            attractionMatrix.at(i).at(j) = value;
-                        }
-                    }
+                    randomizeAttraction(simulation, gen);
+                }
+                if (event.key.code == sf::Keyboard::T) {
+                    printTimings = !printTimings;
+                    timings = PhaseTimings();
+                    timedFrames = 0;
                 }
                 if (event.key.code == sf::Keyboard::Escape) {
                     window.close();
@@ -176,145 +663,41 @@ int main() {
         }
 
         window.clear(sf::Color(0, 0, 0));
-        
+
         // A few variables regarding mouse force
         sf::Vector2i mousePosInt = sf::Mouse::getPosition(window);
-        cursorParticle.position = sf::Vector2f(mousePosInt.x, mousePosInt.y);
+        sf::Vector2f cursorPosition(mousePosInt.x, mousePosInt.y);
         float mouseForce = 100.0;
         float mouseInfluenceRangeMultiplier = 2.0;
 
-        // auto start = std::chrono::high_resolution_clock::now(); //    CLOCK START  
-        #pragma omp parallel for collapse(1)
-        for (Particle &particle : particles) {
-            
-            // Wrap particles around the screen            
-            particle.nearLeftEdge = false;
-            particle.nearRightEdge = false;
-            particle.nearTopEdge = false;
-            particle.nearBottomEdge = false;
-
-            if (particle.position.x < maxDistance) {
-                particle.nearLeftEdge = true;
-                if (particle.position.x < 0) {
-                    particle.position.x = screenWidth - 0.01f;
-                }
-            }
-            if (particle.position.x > screenWidth - maxDistance) {
-                particle.nearRightEdge = true;
-                if (particle.position.x > screenWidth) {
-                    particle.position.x = 0.01f;
-                }
-            }
-
-            if (particle.position.y < maxDistance) {
-                particle.nearTopEdge = true;
-                if (particle.position.y < 0) {
-                    particle.position.y = screenHeight - 0.01f;
-                }
-            }
-            if (particle.position.y > screenHeight - maxDistance) {
-                particle.nearBottomEdge = true;
-                if (particle.position.y > screenHeight) {
-                    particle.position.y = 0.01f;
-                }
-            }
-
-            // Calculate physics
-
-            // Check if self
-            for (Particle &otherParticle : particles) {
-                // Calculate force
-                if (&otherParticle == &particle) {
-                    continue;
-                }
-                interact(particle, otherParticle, &attractionMatrix, maxDistance);
-            }
-            // Mouse controls
-
-            if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, mouseForce);
-
-                cursorParticle.position.x += screenWidth;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, mouseForce);
-                cursorParticle.position.x -= 2*screenWidth;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, mouseForce);
-
-                cursorParticle.position.x += screenWidth;
+        float cursorForce = 0.0f;
+        if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
+            cursorForce = mouseForce;
+        }
+        if (sf::Mouse::isButtonPressed(sf::Mouse::Right)) {
+            cursorForce += -2 * mouseForce;
+        }
 
-                cursorParticle.position.y += screenHeight;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, mouseForce);
-                cursorParticle.position.y -= 2*screenHeight;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, mouseForce);
-                
-                cursorParticle.position.y += screenHeight;
-            }
-            if (sf::Mouse::isButtonPressed(sf::Mouse::Right)) {
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, -2 * mouseForce);
-
-                cursorParticle.position.x += screenWidth;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, -2 * mouseForce);
-                cursorParticle.position.x -= 2*screenWidth;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, -2 * mouseForce);
-
-                cursorParticle.position.x += screenWidth;
-
-                cursorParticle.position.y += screenHeight;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, -2 * mouseForce);
-                cursorParticle.position.y -= 2*screenHeight;
-                interact(particle, cursorParticle, nullptr, maxDistance * mouseInfluenceRangeMultiplier, 0, -2 * mouseForce);
-                
-                cursorParticle.position.y += screenHeight;
+        simulation.step(cursorPosition, cursorForce, maxDistance * mouseInfluenceRangeMultiplier, printTimings ? &timings : nullptr);
+
+        auto drawStart = std::chrono::high_resolution_clock::now();
+        // Draw all particles at once
+        fillBatch(batch, simulation.particles, particleRadius);
+        window.draw(batch);
+
+        // Not counting display(), that is where the frame limit waits
+        if (printTimings) {
+            timings.draw += nanosecondsSince(drawStart);
+            if (++timedFrames == 30) {
+                timings.print(std::cout);
+                std::cout << "\n";
+                timings = PhaseTimings();
+                timedFrames = 0;
             }
-            // Make forces wrap around the edges
-            for (Particle otherParticleUp : particles) {
-                if (otherParticleUp.nearBottomEdge) {
-                    otherParticleUp.position.y -= screenHeight;
-                    interact(particle, otherParticleUp, &attractionMatrix, maxDistance);
-                }
-            }
-            for (Particle otherParticleDown : particles) {
-                if (otherParticleDown.nearTopEdge) {
-                    otherParticleDown.position.y += screenHeight;
-                    interact(particle, otherParticleDown, &attractionMatrix, maxDistance);
-                }
-            }
-            for (Particle otherParticleLeft : particles) {
-                if (otherParticleLeft.nearRightEdge) {
-                    otherParticleLeft.position.x -= screenWidth;
-                    interact(particle, otherParticleLeft, &attractionMatrix, maxDistance);
-                }
-            }
-            for (Particle otherParticleRight : particles) {
-                if (otherParticleRight.nearLeftEdge) {
-                    otherParticleRight.position.x += screenWidth;
-                    interact(particle, otherParticleRight, &attractionMatrix, maxDistance);
-                } 
-            }
-            particle.velocity *= 0.8f;
-            particle.position += particle.velocity * 1.0f;
-        }
-        
-        // auto end = std::chrono::high_resolution_clock::now();   //      CLOCK END
-        // std::chrono::duration<double> elapsed = end - start;
-        // std::cout << "Code took " << elapsed.count() << "s\n";
-
-        for (Particle &particle : particles) {
-            // Draw each particle
-            sf::CircleShape particleShape(particle.radius);
-
-            particleShape.setOrigin(sf::Vector2f(particle.radius, particle.radius));
-            particleShape.setPosition(particle.position);
-            particleShape.setFillColor(sf::Color(
-                hueToRGB((float)particle.color / (float)colorsAmount).x * 255,
-                hueToRGB((float)particle.color / (float)colorsAmount).y * 255,
-                hueToRGB((float)particle.color / (float)colorsAmount).z * 255
-            )); 
-
-            window.draw(particleShape);
         }
         window.display();
 
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -6,6 +6,9 @@
 #include <omp.h>
 #include <iomanip>
 #include <sstream>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
 #include "../../vec.h"
 
 float clamp(float v, float minVal, float maxVal) {
@@ -13,10 +16,8 @@ float clamp(float v, float minVal, float maxVal) {
 }
 
 float wrap(float min, float max, float value) {
-    float newValue = value;
-    while (newValue < min) newValue += max - min;
-    while (newValue > max) newValue -= max - min;
-    return newValue;
+    // One step, the map's angles keep growing for pendulums that spin
+    return value - (max - min) * std::floor((value - min) / (max - min));
 }
 
 sf::Color hsvToRgb(float h, float s, float v) {
@@ -203,18 +204,491 @@ class Pendulum {
         }
 };
 
+// Rounds to the nearest integer (ties to even) for |x| < 2^51. Adding 1.5 * 2^52 leaves no bits
+// for the fraction, and unlike std::floor this vectorizes without -fno-trapping-math.
+inline double roundToInteger(double x) {
+    const double shifter = 6755399441055744.0;
+    return (x + shifter) - shifter;
+}
+
+// sin and cos of x in one go, without branches so it vectorizes inside omp simd loops.
+// x is reduced to r in [-pi/4, pi/4] around a multiple q of pi/2, then both come from
+// the fdlibm polynomials for r and get swapped and negated depending on the quadrant.
+inline void sinCos(double x, double& s, double& c) {
+    double q = roundToInteger(x * (2.0 / M_PI));
+    // pi/2 in three parts, so q * part is exact and r keeps its precision for large angles
+    double r = x - q * 1.57079632673412561417e+00 - q * 6.07710050630396597660e-11 - q * 2.02226624879595063154e-21;
+    double z = r * r;
+
+    double sinR = r + r * z * (-1.66666666666666324348e-01 + z * (8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 +
+                  z * (2.75573137070700676789e-06 + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)))));
+    double cosR = 1.0 - 0.5 * z + z * z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05 +
+                  z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+
+    // q mod 4, q / 4 is a multiple of 0.25 so shifting it by 0.375 rounds it down without ties
+    double quadrant = q - 4.0 * roundToInteger(q * 0.25 - 0.375);
+    bool odd = (quadrant == 1.0) | (quadrant == 3.0);
+    s = odd ? cosR : sinR;
+    c = odd ? sinR : cosR;
+    s = quadrant >= 2.0 ? -s : s;
+    c = (quadrant == 1.0) | (quadrant == 2.0) ? -c : c;
+}
+
+// Many pendulums with the same arms, stored as one array per state variable so the RK4 step runs
+// over all of them in SIMD lanes. Only the state lives here, nothing for drawing.
+class PendulumEnsemble {
+    public:
+        double l1;
+        double l2;
+
+        std::vector<double> th1;
+        std::vector<double> w1;
+        std::vector<double> th2;
+        std::vector<double> w2;
+        // The step size UpdateDormandPrince settled on for each lane, 0 before the first call
+        std::vector<double> step;
+
+        PendulumEnsemble(double l1_, double l2_) {
+            l1 = l1_;
+            l2 = l2_;
+        }
+
+        std::size_t size() const {
+            return th1.size();
+        }
+
+        void add(double startTh1, double startW1, double startTh2, double startW2) {
+            th1.push_back(startTh1);
+            w1.push_back(startW1);
+            th2.push_back(startTh2);
+            w2.push_back(startW2);
+            step.push_back(0);
+        }
+
+        // Angular accelerations of n lanes. Same equations as angularAccel1 and angularAccel2, but written with
+        // the sin and cos of th1 and th2 only, so a lane needs two sinCos instead of seven sin and cos calls.
+        void accelerations(int n, double g,
+                           const double* th1, const double* th2,
+                           const double* w1, const double* w2,
+                           double* a1, double* a2) const
+        {
+            #pragma omp simd
+            for (int i = 0; i < n; ++i) {
+                double s1, c1, s2, c2;
+                sinCos(th1[i], s1, c1);
+                sinCos(th2[i], s2, c2);
+
+                double sinDelta = s1 * c2 - c1 * s2;
+                double cosDelta = c1 * c2 + s1 * s2;
+                double cos2Delta = 1.0 - 2.0 * sinDelta * sinDelta;
+                // sin(th1 - 2 th2)
+                double sinTh1Minus2Th2 = s1 * (c2 * c2 - s2 * s2) - c1 * (2.0 * s2 * c2);
+                double denom = 3.0 - cos2Delta;
+
+                a1[i] = (
+                    -g * 3 * s1
+                    - g * sinTh1Minus2Th2
+                    - 2.0 * sinDelta * (w2[i]*w2[i] * l2 + w1[i]*w1[i] * l1 * cosDelta)
+                ) / (l1 * denom);
+                a2[i] = (
+                    2.0 * sinDelta * (
+                        w1[i]*w1[i] * l1 * 2
+                        + g * 2 * c1
+                        + w2[i]*w2[i] * l2 * cosDelta)
+                ) / (l2 * denom);
+            }
+        }
+
+        void UpdateRK4(double g, double dt) {
+            long count = size();
+
+            // Blocks small enough that the stage arrays stay in L1
+            #pragma omp parallel for schedule(static)
+            for (long start = 0; start < count; start += block) {
+                int n = std::min<long>(block, count - start);
+                double* th1s = th1.data() + start;
+                double* w1s = w1.data() + start;
+                double* th2s = th2.data() + start;
+                double* w2s = w2.data() + start;
+
+                // The state a stage is evaluated at, and the weighted sum of the stage slopes
+                double stageTh1[block], stageW1[block], stageTh2[block], stageW2[block];
+                double a1[block], a2[block];
+                double sumTh1[block] = {}, sumW1[block] = {}, sumTh2[block] = {}, sumW2[block] = {};
+                std::copy_n(th1s, n, stageTh1);
+                std::copy_n(w1s, n, stageW1);
+                std::copy_n(th2s, n, stageTh2);
+                std::copy_n(w2s, n, stageW2);
+
+                for (int stage = 0; stage < 4; ++stage) {
+                    accelerations(n, g, stageTh1, stageTh2, stageW1, stageW2, a1, a2);
+
+                    double weight = stage == 0 || stage == 3 ? 1.0 : 2.0;
+                    double next = stage < 2 ? 0.5*dt : dt;
+                    #pragma omp simd
+                    for (int i = 0; i < n; ++i) {
+                        sumTh1[i] += weight * stageW1[i];
+                        sumW1[i]  += weight * a1[i];
+                        sumTh2[i] += weight * stageW2[i];
+                        sumW2[i]  += weight * a2[i];
+
+                        stageTh1[i] = th1s[i] + next * stageW1[i];
+                        stageW1[i]  = w1s[i]  + next * a1[i];
+                        stageTh2[i] = th2s[i] + next * stageW2[i];
+                        stageW2[i]  = w2s[i]  + next * a2[i];
+                    }
+                }
+
+                #pragma omp simd
+                for (int i = 0; i < n; ++i) {
+                    th1s[i] += dt/6.0 * sumTh1[i];
+                    w1s[i]  += dt/6.0 * sumW1[i];
+                    th2s[i] += dt/6.0 * sumTh2[i];
+                    w2s[i]  += dt/6.0 * sumW2[i];
+                }
+            }
+        }
+
+        // Advances every lane by duration with Dormand-Prince 5(4). Each lane picks its own step size so
+        // the estimated local error stays under tolerance, and keeps it for the next call. Lanes of a
+        // block step together, a lane that has already arrived just sits out the remaining trial steps.
+        void UpdateDormandPrince(double g, double duration, double tolerance) {
+            // Butcher tableau, the last row is also the 5th order solution
+            static const double a[7][6] = {
+                {},
+                {1.0/5},
+                {3.0/40, 9.0/40},
+                {44.0/45, -56.0/15, 32.0/9},
+                {19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729},
+                {9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, -5103.0/18656},
+                {35.0/384, 0, 500.0/1113, 125.0/192, -2187.0/6784, 11.0/84}
+            };
+            // 5th minus 4th order weights
+            const double e1 = 71.0/57600, e3 = -71.0/16695, e4 = 71.0/1920, e5 = -17253.0/339200, e6 = 22.0/525, e7 = -1.0/40;
+            long count = size();
+
+            // Chaotic blocks need many more steps than calm ones
+            #pragma omp parallel for schedule(dynamic)
+            for (long start = 0; start < count; start += block) {
+                int n = std::min<long>(block, count - start);
+                // th1, w1, th2, w2 like everywhere else
+                double* y[4] = {th1.data() + start, w1.data() + start, th2.data() + start, w2.data() + start};
+                double* steps = step.data() + start;
+
+                // Slopes of the 7 stages, the last one is the first of the next step (FSAL)
+                double k[7][4][block];
+                double stage[4][block];
+                double h[block], remaining[block];
+
+                for (int i = 0; i < n; ++i) {
+                    remaining[i] = duration;
+                    h[i] = std::min(steps[i] > 0 ? steps[i] : duration, duration);
+                }
+                std::copy_n(y[1], n, k[0][0]);
+                std::copy_n(y[3], n, k[0][2]);
+                accelerations(n, g, y[0], y[2], y[1], y[3], k[0][1], k[0][3]);
+
+                while (true) {
+                    int active = 0;
+                    #pragma omp simd reduction(+:active)
+                    for (int i = 0; i < n; ++i) {
+                        active += remaining[i] > 0;
+                    }
+                    if (active == 0) {
+                        break;
+                    }
+
+                    for (int s = 1; s < 7; ++s) {
+                        for (int v = 0; v < 4; ++v) {
+                            std::copy_n(y[v], n, stage[v]);
+                            for (int j = 0; j < s; ++j) {
+                                double coefficient = a[s][j];
+                                #pragma omp simd
+                                for (int i = 0; i < n; ++i) {
+                                    stage[v][i] += h[i] * coefficient * k[j][v][i];
+                                }
+                            }
+                        }
+                        std::copy_n(stage[1], n, k[s][0]);
+                        std::copy_n(stage[3], n, k[s][2]);
+                        accelerations(n, g, stage[0], stage[2], stage[1], stage[3], k[s][1], k[s][3]);
+                    }
+
+                    // Error of the 4th order solution relative to tolerance, RMS over the four variables
+                    double error[block] = {};
+                    for (int v = 0; v < 4; ++v) {
+                        #pragma omp simd
+                        for (int i = 0; i < n; ++i) {
+                            double estimate = h[i] * (e1*k[0][v][i] + e3*k[2][v][i] + e4*k[3][v][i] +
+                                                      e5*k[4][v][i] + e6*k[5][v][i] + e7*k[6][v][i]);
+                            double scale = tolerance * (1.0 + std::max(std::fabs(y[v][i]), std::fabs(stage[v][i])));
+                            error[i] += (estimate / scale) * (estimate / scale);
+                        }
+                    }
+
+                    for (int i = 0; i < n; ++i) {
+                        if (remaining[i] <= 0) {
+                            continue;
+                        }
+                        double laneError = std::sqrt(error[i] * 0.25);
+                        // NaN counts as accepted, a lane that blew up shouldn't stall the block
+                        bool accepted = !(laneError > 1.0);
+                        if (accepted) {
+                            for (int v = 0; v < 4; ++v) {
+                                y[v][i] = stage[v][i];
+                                k[0][v][i] = k[6][v][i];
+                            }
+                            remaining[i] -= h[i];
+                        }
+
+                        double factor = std::clamp(0.9 * std::pow(std::max(laneError, 1e-10), -0.2), 0.2, 5.0);
+                        // A step cut short to land on duration says nothing about the step size that works
+                        bool cut = h[i] < steps[i];
+                        double next = std::max(h[i] * factor, duration * 1e-9);
+                        steps[i] = accepted && cut ? std::max(steps[i], next) : next;
+                        h[i] = std::min(steps[i], remaining[i]);
+                    }
+                }
+            }
+        }
+
+    private:
+        static const int block = 256;
+};
+
+// Advances the ensemble by stepsPerFrame * dt, in fixed RK4 steps or adaptively when tolerance > 0
+void advanceEnsemble(PendulumEnsemble& pendulums, double g, double dt, int stepsPerFrame, double tolerance) {
+    if (tolerance > 0) {
+        pendulums.UpdateDormandPrince(g, stepsPerFrame * dt, tolerance);
+    } else {
+        for (int i = 0; i < stepsPerFrame; ++i) {
+            pendulums.UpdateRK4(g, dt);
+        }
+    }
+}
+
+// Accumulates, for every pendulum of an ensemble, the time of its first flip (either arm passing over the top)
+// and its finite-time Lyapunov exponent. The exponent comes from a shadow ensemble started a tiny distance
+// away in state space, the distance is measured and scaled back to the start distance after every advance
+// (Benettin's method) and the logs of the growth add up.
+class DivergenceAnalysis {
+    public:
+        double separation;
+        double time = 0;
+        PendulumEnsemble shadow;
+
+        // Simulated time of the first flip, -1 for not yet
+        std::vector<float> flipTime;
+        std::vector<float> logGrowth;
+
+        DivergenceAnalysis(const PendulumEnsemble& pendulums, double separation_) : shadow(pendulums) {
+            separation = separation_;
+            flipTime.assign(pendulums.size(), -1);
+            logGrowth.assign(pendulums.size(), 0);
+
+            // Which 2 pi wide cell, centered on hanging down, each arm starts in. A flip leaves it.
+            for (std::size_t i = 0; i < pendulums.size(); ++i) {
+                startCell1.push_back(cellOf(pendulums.th1[i]));
+                startCell2.push_back(cellOf(pendulums.th2[i]));
+            }
+
+            // Equally in all four directions
+            double offset = separation / 2;
+            for (std::size_t i = 0; i < shadow.size(); ++i) {
+                shadow.th1[i] += offset;
+                shadow.w1[i] += offset;
+                shadow.th2[i] += offset;
+                shadow.w2[i] += offset;
+            }
+        }
+
+        // Call after pendulums and shadow were both advanced by duration
+        void record(const PendulumEnsemble& pendulums, double duration) {
+            time += duration;
+            long count = pendulums.size();
+
+            #pragma omp parallel for schedule(static)
+            for (long i = 0; i < count; ++i) {
+                if (flipTime[i] < 0 && (cellOf(pendulums.th1[i]) != startCell1[i] || cellOf(pendulums.th2[i]) != startCell2[i])) {
+                    flipTime[i] = time;
+                }
+
+                double d1 = shadow.th1[i] - pendulums.th1[i];
+                double d2 = shadow.w1[i] - pendulums.w1[i];
+                double d3 = shadow.th2[i] - pendulums.th2[i];
+                double d4 = shadow.w2[i] - pendulums.w2[i];
+                double distance = std::sqrt(d1*d1 + d2*d2 + d3*d3 + d4*d4);
+                if (distance > 0 && std::isfinite(distance)) {
+                    logGrowth[i] += std::log(distance / separation);
+                    double scale = separation / distance;
+                    shadow.th1[i] = pendulums.th1[i] + d1 * scale;
+                    shadow.w1[i] = pendulums.w1[i] + d2 * scale;
+                    shadow.th2[i] = pendulums.th2[i] + d3 * scale;
+                    shadow.w2[i] = pendulums.w2[i] + d4 * scale;
+                }
+            }
+        }
+
+        float lyapunov(std::size_t i) const {
+            return time > 0 ? logGrowth[i] / time : 0;
+        }
+
+    private:
+        std::vector<int> startCell1;
+        std::vector<int> startCell2;
+
+        static int cellOf(double angle) {
+            return (int)std::floor((angle + M_PI) / (2 * M_PI));
+        }
+};
+
+// name.png writes name_flip.png and name_lyapunov.png, with pendulum (i, j) at pixel (i, j). Anything else
+// is a binary file: the resolution as int32, then the flip times and then the exponents as float32, row by row.
+bool saveAnalysis(const DivergenceAnalysis& analysis, int resolution, const std::string& path) {
+    std::size_t count = analysis.flipTime.size();
+
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".png") == 0) {
+        std::string base = path.substr(0, path.size() - 4);
+        float maxLyapunov = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            maxLyapunov = std::max(maxLyapunov, analysis.lyapunov(i));
+        }
+
+        sf::Image flips, lyapunov;
+        flips.create(resolution, resolution);
+        lyapunov.create(resolution, resolution);
+        for (int i = 0; i < resolution; ++i) {
+            for (int j = 0; j < resolution; ++j) {
+                // Black if it never flipped, otherwise the hue goes around with log time
+                float flipTime = analysis.flipTime[j * resolution + i];
+                sf::Color flipColor = flipTime < 0 ? sf::Color::Black : hsvToRgb(300.f * std::log1p(flipTime) / std::log1p(analysis.time), 1, 1);
+                flips.setPixel(i, j, flipColor);
+
+                // Blue for regular up to red for the most chaotic
+                float exponent = std::max(0.0f, analysis.lyapunov(j * resolution + i));
+                lyapunov.setPixel(i, j, hsvToRgb(240.f * (1 - exponent / std::max(maxLyapunov, 1e-6f)), 1, 1));
+            }
+        }
+        return flips.saveToFile(base + "_flip.png") && lyapunov.saveToFile(base + "_lyapunov.png");
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    std::int32_t size = resolution;
+    file.write((const char*)&size, sizeof(size));
+    file.write((const char*)analysis.flipTime.data(), count * sizeof(float));
+    std::vector<float> lyapunov(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        lyapunov[i] = analysis.lyapunov(i);
+    }
+    file.write((const char*)lyapunov.data(), count * sizeof(float));
+    return (bool)file;
+}
+
+// Draws the map, every pendulum in the colormap color of its current angles. The colormap is one flat
+// RGBA table and the colors go straight into a pixel buffer the size of the colormap, written once per
+// frame and uploaded in one go. Which pendulum colors which pixel never changes, so that's worked out
+// once per axis: pendulum i starts a block of ceil(spacing) pixels and later blocks overwrite earlier ones.
+class MapRenderer : public sf::Drawable {
+    public:
+    MapRenderer(const sf::Image& colorMap, int resolution_, float scale) {
+        width = colorMap.getSize().x;
+        height = colorMap.getSize().y;
+        resolution = resolution_;
+
+        colorLookup.resize(width * height);
+        std::memcpy(colorLookup.data(), colorMap.getPixelsPtr(), width * height * 4);
+        laneColors.resize(resolution * resolution);
+        pixels.resize(width * height);
+
+        columnSource = sources(width);
+        rowSource = sources(height);
+
+        texture.create(width, height);
+        sprite.setTexture(texture);
+        sprite.setScale(sf::Vector2f(scale, scale));
+    }
+
+    void update(const PendulumEnsemble& pendulums, float graphWorldSize) {
+        long count = pendulums.size();
+
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < count; ++i) {
+            float th1 = wrap(-M_PI, M_PI, pendulums.th1[i]);
+            float th2 = wrap(-M_PI, M_PI, pendulums.th2[i]);
+
+            // Map current (th1, th2) to source pixel in the color map
+            sf::Vector2f srcPx = worldToPixel(Vector2(th1, th2), width, graphWorldSize);
+            int srcX = std::clamp((int)srcPx.x, 0, width - 1);
+            int srcY = std::clamp((int)srcPx.y, 0, height - 1);
+            laneColors[i] = colorLookup[srcY * width + srcX];
+        }
+
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            const sf::Uint32* sourceRow = &laneColors[rowSource[y] * resolution];
+            sf::Uint32* row = &pixels[y * width];
+            for (int x = 0; x < width; ++x) {
+                row[x] = sourceRow[columnSource[x]];
+            }
+        }
+
+        texture.update(reinterpret_cast<const sf::Uint8*>(pixels.data()));
+    }
+
+    private:
+        int width;
+        int height;
+        int resolution;
+
+        // RGBA bytes in memory order, one Uint32 per pixel
+        std::vector<sf::Uint32> colorLookup;
+        std::vector<sf::Uint32> laneColors;
+        std::vector<sf::Uint32> pixels;
+        std::vector<int> columnSource;
+        std::vector<int> rowSource;
+
+        sf::Texture texture;
+        sf::Sprite sprite;
+
+    std::vector<int> sources(int size) const {
+        std::vector<int> source(size, -1);
+        int fill = std::max(1, (int)std::ceil((double)(size - 1) / (resolution - 1)));
+        for (int i = 0; i < resolution; ++i) {
+            int start = (int)((double)i / (resolution - 1) * (size - 1));
+            for (int k = start; k < std::min(start + fill, size); ++k) {
+                source[k] = i;
+            }
+        }
+        // Rounding can leave a pixel between two blocks, it goes with the one before
+        for (int k = 1; k < size; ++k) {
+            if (source[k] < 0) {
+                source[k] = source[k - 1];
+            }
+        }
+        return source;
+    }
+
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        target.draw(sprite, states);
+    }
+};
+
 int main() {
     bool running = true;
     bool doGenerateMap;
+    bool doAnalysis;
 
-    std::cout << "\nstate space? (y/n)\n";
+    std::cout << "\nstate space? (y/n, a for a headless flip time and Lyapunov analysis)\n";
     std::string input;
     std::cin >> input;
-    doGenerateMap = (input == "y" || input == "Y");
+    doAnalysis = (input == "a" || input == "A");
+    doGenerateMap = (input == "y" || input == "Y" || doAnalysis);
 
-    int screenPixelSize;
-    std::cout << "\nscreen size: ";
-    std::cin >> screenPixelSize;
+    int screenPixelSize = 1000;
+    if (!doAnalysis) {
+        std::cout << "\nscreen size: ";
+        std::cin >> screenPixelSize;
+    }
     const float graphWorldSize  = 2.0f * M_PI;
 
     sf::RenderWindow simulationWindow;
@@ -228,37 +702,29 @@ int main() {
         simulationWindow.setFramerateLimit(120);
     }
 
-    // Color map setup
-    sf::Image originalColorMap;
-    if (!originalColorMap.loadFromFile("./colormap.png")) return 1;
-    unsigned int cmW = originalColorMap.getSize().x;
-    unsigned int cmH = originalColorMap.getSize().y;
-
     int resolution = 1000;
     if (doGenerateMap) {
         std::cout << "\nresolution: ";
         std::cin >> resolution;
     }
-    sf::Image currentColorMap;
-    currentColorMap.create(cmW, cmH);
-
-    sf::Texture texture;
-    texture.loadFromImage(currentColorMap);
-    sf::Sprite sprite(texture);
-    sprite.setScale(sf::Vector2f(screenPixelSize / 1000.0f, screenPixelSize / 1000.0f));
 
-    std::vector<std::vector<sf::Color>> originalColorValues(cmH, std::vector<sf::Color>(cmW));
-    std::vector<std::vector<sf::Color>> currentColorValues (cmH, std::vector<sf::Color>(cmW));
-    std::vector<std::vector<Pendulum>>  pendulums(resolution, std::vector<Pendulum>(resolution));
+    Pendulum pendulum;
+    // pendulum (i, j) of the map is at j * resolution + i, they all start with the velocities of this one
+    PendulumEnsemble pendulums(pendulum.l1, pendulum.l2);
 
     Vector2 viewCenter(0.0, 0.0);
     double viewSideLength = 2 * M_PI;
+    // Physics steps of dt between texture uploads, and the error tolerance when they're adaptive
+    int stepsPerFrame = 1;
+    double tolerance = 0;
     
     
 
     if (doGenerateMap) {
-        mapWindow.create(sf::VideoMode(screenPixelSize, screenPixelSize), "colormap");
-        mapWindow.setFramerateLimit(60);
+        if (!doAnalysis) {
+            mapWindow.create(sf::VideoMode(screenPixelSize, screenPixelSize), "colormap");
+            mapWindow.setFramerateLimit(60);
+        }
 
         std::cout << "\nx center: ";
         std::cin >> viewCenter.x;
@@ -272,18 +738,17 @@ int main() {
             viewSideLength = 2 * M_PI;
         }
 
-        for (unsigned int y = 0; y < cmH; ++y)
-            for (unsigned int x = 0; x < cmW; ++x)
-                originalColorValues[y][x] = currentColorValues[y][x] = originalColorMap.getPixel(x, y);
+        std::cout << "steps per frame: ";
+        std::cin >> stepsPerFrame;
+        std::cout << "\nadaptive tolerance (0 for fixed RK4 steps): ";
+        std::cin >> tolerance;
+        std::cout << "\n";
 
-        for (int i = 0; i < resolution; ++i) {
-            for (int j = 0; j < resolution; ++j) {
-                Pendulum p;
+        for (int j = 0; j < resolution; ++j) {
+            for (int i = 0; i < resolution; ++i) {
                 double th1 = viewCenter.x + ((double)i / (resolution - 1) - 0.5) * viewSideLength;
                 double th2 = viewCenter.y + ((double)j / (resolution - 1) - 0.5) * viewSideLength;
-                p.th1 = th1;
-                p.th2 = th2;
-                pendulums[i][j] = p;
+                pendulums.add(th1, pendulum.w1, th2, pendulum.w2);
             }
         }
     }
@@ -293,8 +758,39 @@ int main() {
 
     double G  = 100;
     double dt = 0.007;
+    double simulatedTime = 0;
+
+    // Runs to the target time without any window, flips are checked after every stepsPerFrame steps
+    if (doAnalysis) {
+        double targetTime;
+        std::string outputPath;
+        std::cout << "target time: ";
+        std::cin >> targetTime;
+        std::cout << "\noutput (name.png for images, anything else for raw floats): ";
+        std::cin >> outputPath;
+        std::cout << "\n";
+
+        DivergenceAnalysis analysis(pendulums, 1e-8);
+        while (analysis.time < targetTime) {
+            advanceEnsemble(pendulums, G, dt, stepsPerFrame, tolerance);
+            advanceEnsemble(analysis.shadow, G, dt, stepsPerFrame, tolerance);
+            analysis.record(pendulums, stepsPerFrame * dt);
+            std::cout << "\rt = " << analysis.time << std::flush;
+        }
+        std::cout << "\n";
+
+        if (!saveAnalysis(analysis, resolution, outputPath)) {
+            std::cout << "couldn't write " << outputPath << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // Color map setup, after the analysis since the texture needs a display
+    sf::Image originalColorMap;
+    if (!originalColorMap.loadFromFile("./colormap.png")) return 1;
+    MapRenderer mapRenderer(originalColorMap, resolution, screenPixelSize / 1000.0f);
 
-    Pendulum pendulum;
     std::vector<sf::Vector2f> graphTrail;
     graphTrail.reserve(2500);
 
@@ -377,45 +873,18 @@ int main() {
                 worldPosition.say();
             }
 
-            #pragma omp parallel for collapse(2)
-            for (int x = 0; x < resolution; ++x) {
-                for (int y = 0; y < resolution; ++y) {
-                    pendulums[x][y].UpdatePendulumRK4(G, dt);
-
-                    float th1 = wrap(-M_PI, M_PI, pendulums[x][y].th1);
-                    float th2 = wrap(-M_PI, M_PI, pendulums[x][y].th2);
-
-                    // Map current (th1, th2) to source pixel in the color map
-                    sf::Vector2f srcPx = worldToPixel(Vector2(th1, th2), cmW, graphWorldSize);
-                    int srcX = std::clamp((int)srcPx.x, 0, (int)cmW - 1);
-                    int srcY = std::clamp((int)srcPx.y, 0, (int)cmH - 1);
-
-                    int dstX = (int)((double)x / (resolution - 1) * (cmW - 1));
-                    int dstY = (int)((double)y / (resolution - 1) * (cmH - 1));
-                    
-                    sf::Color c = originalColorValues[srcY][srcX];
-
-                    int fill = std::ceil(screenPixelSize / resolution);
-                    for (int i = 0; i < fill; ++i) {
-                        for (int j = 0; j < fill; ++j) {
-                            int px = dstX + i, py = dstY + j;
-                            if (px >= 0 && py >= 0 && px < (int)cmW && py < (int)cmH) {
-                                currentColorValues[py][px] = c;
-                                currentColorMap.setPixel(px, py, c);
-                            }
-                        }
-                    }
-                }
-            }
-            texture.update(currentColorMap);
+            advanceEnsemble(pendulums, G, dt, stepsPerFrame, tolerance);
+            simulatedTime += stepsPerFrame * dt;
+
+            mapRenderer.update(pendulums, graphWorldSize);
 
             fpsCounter++;
-            mapWindow.draw(sprite);
+            mapWindow.draw(mapRenderer);
             mapWindow.display();
 
             float elapsed = clock.getElapsedTime().asSeconds();
             if (elapsed >= 1.0f) {
-                std::cout << "FPS: " << fpsCounter / elapsed << std::endl;
+                std::cout << "FPS: " << fpsCounter / elapsed << ", t = " << simulatedTime << std::endl;
                 fpsCounter = 0;
                 clock.restart();
             }
@@ -67,6 +67,15 @@ Vector4 rungeKuttaStep(Vector4 current, double dt) {
 	return (k1 + k2*2.0 + k3*2.0 + k4) * (dt/6.0) ;
 }
 
+// The trajectory only depends on its start and dt, so it's integrated once and only ever extended
+void extendTrajectory(std::vector<Vector4>& trajectory, int length, double dt) {
+	while ((int)trajectory.size() < length) {
+		Vector4 current = trajectory.back();
+		current += rungeKuttaStep(current, dt);
+		trajectory.push_back(current);
+	}
+}
+
 
 float logNormalize(float v, float vMin, float vMax)
 {
@@ -145,9 +154,13 @@ int main () {
 
 	// Path variables
 	int pathLength = 100000;
+	int pathGrowSpeed = 1000; // Points added or removed per frame while E or Q is held
 	float dt = 0.005;
 	Vector4 trajectoryStart(-2.25223, 0.0, -0.746236, 0.0);
 
+	std::vector<Vector4> trajectory = {trajectoryStart};
+	std::vector<sf::Vertex> rungeKuttaPath;
+
 
 	// Camera variables
 	Vector3 cameraPos(0.0, 0.0, 0.0);
@@ -206,27 +219,23 @@ int main () {
 		}
 		cameraPos = cameraCenter + Vector3::getForward(cameraRot) * -cameraDistanceFromCenter;
 
-		// sf::Vertex eulerPathBad[pathLength];
-		// sf::Vertex eulerPathGood[pathLength];
-		sf::Vertex rungeKuttaPath[pathLength];
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::E)) {
+			pathLength += pathGrowSpeed;
+		}
+		if (sf::Keyboard::isKeyPressed(sf::Keyboard::Q) && pathLength > pathGrowSpeed) {
+			pathLength -= pathGrowSpeed;
+		}
 
-		// Vector3 currentValueEulerBad = trajectoryStart;
-		// Vector3 currentValueEulerGood = trajectoryStart;
-		Vector4 currentValueRungeKutta = trajectoryStart;
+		// Only new points get integrated, every frame just projects the cached ones
+		extendTrajectory(trajectory, pathLength, dt);
+		rungeKuttaPath.resize(pathLength);
 
+		#pragma omp parallel for
 		for (int i = 0; i < pathLength; i++) {
-			// eulerPathBad[i] = sf::Vertex(worldToPixel3D(currentValueEulerBad, cameraPos, cameraRot, screenPixelSize, 90), sf::Color::Blue);
-			// eulerPathGood[i] = sf::Vertex(worldToPixel3D(currentValueEulerGood, cameraPos, cameraRot, screenPixelSize, 90), sf::Color::Yellow);	
-			rungeKuttaPath[i] = sf::Vertex(worldToPixel3D(Vector4::vec4tovec3(currentValueRungeKutta), cameraPos, cameraRot, screenPixelSize, 90), sf::Color(255, 255, 255 - std::abs(currentValueRungeKutta.w) * 10, 255));
-
-			// currentValueEulerBad += vectorFieldVector(currentValueEulerBad.x, currentValueEulerBad.y, currentValueEulerBad.z) * dt;
-			// currentValueEulerGood += vectorFieldVector(currentValueEulerGood.x, currentValueEulerGood.y, currentValueEulerGood.z) * dt / 100.0;
-			currentValueRungeKutta += rungeKuttaStep(currentValueRungeKutta, dt);
+			rungeKuttaPath[i] = sf::Vertex(worldToPixel3D(Vector4::vec4tovec3(trajectory[i]), cameraPos, cameraRot, screenPixelSize, 90), sf::Color(255, 255, 255 - std::abs(trajectory[i].w) * 10, 255));
 		}
 
-		// window.draw(eulerPathBad, pathLength, sf::LineStrip);
-		// window.draw(eulerPathGood, pathLength, sf::LineStrip);
-		window.draw(rungeKuttaPath, pathLength, sf::LineStrip);
+		window.draw(rungeKuttaPath.data(), pathLength, sf::LineStrip);
 
 
 		// drawing arrows
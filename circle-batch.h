@@ -0,0 +1,100 @@
+#pragma once
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Draws any number of circles with a single draw call. All circles live in one persistent
+// sf::VertexArray, either as textured quads (the texture is one smooth white disc that gets
+// tinted by the vertex color) or as single points for very small or very many particles.
+// Colors can be cached per color index in the palette.
+class CircleBatch : public sf::Drawable {
+    public:
+        enum Mode { Discs, Points };
+
+        std::vector<sf::Color> palette;
+
+    CircleBatch(Mode mode_ = Discs) {
+        mode = mode_;
+        vertices.setPrimitiveType(mode == Discs ? sf::Quads : sf::Points);
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    void resize(std::size_t count_) {
+        count = count_;
+        vertices.resize(count * verticesPerCircle());
+    }
+
+    // Place circle i. Safe to call for different i from several threads.
+    void set(std::size_t i, sf::Vector2f position, float radius, sf::Color color) {
+        if (mode == Points) {
+            vertices[i].position = position;
+            vertices[i].color = color;
+            return;
+        }
+
+        sf::Vertex* quad = &vertices[i * 4];
+        quad[0].position = sf::Vector2f(position.x - radius, position.y - radius);
+        quad[1].position = sf::Vector2f(position.x + radius, position.y - radius);
+        quad[2].position = sf::Vector2f(position.x + radius, position.y + radius);
+        quad[3].position = sf::Vector2f(position.x - radius, position.y + radius);
+
+        quad[0].texCoords = sf::Vector2f(0, 0);
+        quad[1].texCoords = sf::Vector2f(discSize, 0);
+        quad[2].texCoords = sf::Vector2f(discSize, discSize);
+        quad[3].texCoords = sf::Vector2f(0, discSize);
+
+        for (int k = 0; k < 4; ++k) {
+            quad[k].color = color;
+        }
+    }
+
+    void set(std::size_t i, sf::Vector2f position, float radius, int colorIndex) {
+        set(i, position, radius, palette[colorIndex]);
+    }
+
+    private:
+        static const int discSize = 64;
+
+        Mode mode;
+        std::size_t count = 0;
+        sf::VertexArray vertices;
+
+        // Created on the first draw, so a batch can be filled without any OpenGL context (e.g. headless)
+        mutable sf::Texture disc;
+
+    int verticesPerCircle() const {
+        return mode == Discs ? 4 : 1;
+    }
+
+    void createDisc() const {
+        sf::Image image;
+        image.create(discSize, discSize, sf::Color::Transparent);
+
+        float center = discSize / 2.0f;
+        for (int x = 0; x < discSize; ++x) {
+            for (int y = 0; y < discSize; ++y) {
+                float distance = std::hypot(x + 0.5f - center, y + 0.5f - center);
+                // One texel of anti-aliasing at the edge
+                float alpha = std::clamp(center - distance, 0.0f, 1.0f);
+                image.setPixel(x, y, sf::Color(255, 255, 255, static_cast<sf::Uint8>(alpha * 255)));
+            }
+        }
+
+        disc.loadFromImage(image);
+        disc.setSmooth(true);
+    }
+
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        if (mode == Discs) {
+            if (disc.getSize().x == 0) {
+                createDisc();
+            }
+            states.texture = &disc;
+        }
+        target.draw(vertices, states);
+    }
+};